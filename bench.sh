@@ -0,0 +1,280 @@
+# Benchmarks every operator and a few pipelines over generated corpora and writes the results as JSON.
+# Usage: sh bench.sh [-s sizes] [-c corpora] [-f name] [-r runs] [-o results.json] [-b baseline.json] [-t percent]
+#   -s  input sizes, default "1K 1M 16M" (K, M and G suffixes, up to 1G)
+#   -c  corpora, default "text logs csv binary"
+#   -f  only run benchmarks whose name contains this
+#   -r  runs per benchmark, the fastest one counts (default 3)
+#   -o  where to write the results (default bench.json)
+#   -b  results of an earlier run to compare with; exits with 1 if a benchmark got slower by more than -t percent (default 10)
+# The corpora are generated from a fixed seed, so every run sees the same bytes. They are kept in
+# bench-corpus (or $EGG_BENCH_CORPUS). Cycles per byte assume the clock speed in /proc/cpuinfo,
+# or $EGG_BENCH_GHZ.
+
+sizes="1K 1M 16M"
+corpora="text logs csv binary"
+filter=""
+runs=3
+output=bench.json
+baseline=""
+threshold=10
+while getopts "s:c:f:r:o:b:t:" option; do
+    case $option in
+        s) sizes=$OPTARG ;;
+        c) corpora=$OPTARG ;;
+        f) filter=$OPTARG ;;
+        r) runs=$OPTARG ;;
+        o) output=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        *) exit 2 ;;
+    esac
+done
+
+corpus_dir=${EGG_BENCH_CORPUS:-bench-corpus}
+mkdir -p "$corpus_dir"
+ghz=${EGG_BENCH_GHZ:-$(awk -F: '/cpu MHz/ { printf "%.3f", $2 / 1000; exit }' /proc/cpuinfo 2>/dev/null)}
+ghz=${ghz:-1}
+results=$(mktemp)
+scratch=$(mktemp)
+trap 'rm -f "$results" "$scratch"' EXIT
+
+bytes() {
+    case $1 in
+        *K) echo $((${1%K} * 1024)) ;;
+        *M) echo $((${1%M} * 1024 * 1024)) ;;
+        *G) echo $((${1%G} * 1024 * 1024 * 1024)) ;;
+        *) echo "$1" ;;
+    esac
+}
+
+# Writes one block of a corpus, which is repeated up to the wanted size. The random numbers come
+# from the Park-Miller generator, whose products stay exact in awk's doubles.
+block() {
+    case $1 in
+        text) awk 'function rand31() { seed = (seed * 16807) % 2147483647; return seed }
+            BEGIN {
+                n = split("the of and to in is was for on that with as by at from his her it an were are which this be or has had not but one two first new after also who their its into time year other more most may some city people world when between over only made part them team these during about him than then such", words, " ")
+                seed = 42
+                while (size < 1048576) {
+                    line = ""
+                    count = 6 + rand31() % 12
+                    for (k = 0; k < count; ++k) {
+                        word = words[1 + rand31() % n]
+                        if (k == 0) word = toupper(substr(word, 1, 1)) substr(word, 2)
+                        line = line (k ? " " : "") word
+                    }
+                    line = line (rand31() % 4 ? "." : ",")
+                    print line
+                    size += length(line) + 1
+                }
+            }' ;;
+        logs) awk 'function rand31() { seed = (seed * 16807) % 2147483647; return seed }
+            BEGIN {
+                split("INFO INFO INFO INFO DEBUG WARN ERROR", levels, " ")
+                split("/api/users /api/orders /api/items /health /login /static/app.js", paths, " ")
+                split("200 200 200 201 204 301 404 500", statuses, " ")
+                seed = 7
+                while (size < 1048576) {
+                    t += rand31() % 1000
+                    line = sprintf("2024-03-%02dT%02d:%02d:%02d.%03dZ %-5s [worker-%d] request id=%08x path=%s status=%s ms=%d",
+                        1 + int(t / 86400000) % 28, int(t / 3600000) % 24, int(t / 60000) % 60, int(t / 1000) % 60, t % 1000,
+                        levels[1 + rand31() % 7], rand31() % 16, rand31() % 2147483647, paths[1 + rand31() % 6],
+                        statuses[1 + rand31() % 8], rand31() % 2000)
+                    print line
+                    size += length(line) + 1
+                }
+            }' ;;
+        csv) awk 'function rand31() { seed = (seed * 16807) % 2147483647; return seed }
+            BEGIN {
+                split("Alice Bob Carol Dave Erin Frank Grace Heidi Ivan Judy", names, " ")
+                split("Berlin Paris Tokyo Lima Oslo Cairo Austin Perth", cities, " ")
+                seed = 1234
+                print "id,name,city,amount,date"
+                size = 25
+                for (id = 1; size < 1048576; ++id) {
+                    line = sprintf("%d,%s,%s,%d.%02d,2024-%02d-%02d", id, names[1 + rand31() % 10], cities[1 + rand31() % 8],
+                        rand31() % 10000, rand31() % 100, 1 + rand31() % 12, 1 + rand31() % 28)
+                    print line
+                    size += length(line) + 1
+                }
+            }' ;;
+        # a whole number of base64 groups, so that repeating it keeps the base64 corpus valid
+        binary) awk 'function rand31() { seed = (seed * 16807) % 2147483647; return seed }
+            BEGIN {
+                seed = 99
+                for (k = 0; k < 786432; k += 32) {
+                    line = ""
+                    for (j = 0; j < 32; ++j) line = line sprintf("%02x", rand31() % 256)
+                    printf "%s", line
+                }
+            }' | ./egg "H" ;;
+        base64) block binary | ./egg "b" ;;
+    esac
+}
+
+# Prints the path of a corpus of the given kind and size, generating it the first time.
+corpus() {
+    file="$corpus_dir/$1-$2"
+    if [ ! -f "$file" ]; then
+        block "$1" > "$scratch"
+        repeats=$(($2 / $(wc -c < "$scratch") + 1))
+        i=0
+        while [ $i -lt $repeats ]; do
+            cat "$scratch"
+            i=$((i + 1))
+        done | head -c "$2" > "$file"
+    fi
+    echo "$file"
+}
+
+now() {
+    date +%s%N
+}
+
+# Records a result and prints it: name, transformation, corpus, bytes, nanoseconds, allocations and, optionally, requests.
+record() {
+    NAME=$1 TRANSFORMATION=$2 awk -v corpus="$3" -v bytes="$4" -v ns="$5" -v allocations="$6" -v requests="$7" \
+        -v ghz="$ghz" -v results="$results" '
+        function json(text) {
+            gsub(/\\/, "\\\\", text)
+            gsub(/"/, "\\\"", text)
+            return "\"" text "\""
+        }
+        BEGIN {
+            seconds = (ns > 0 ? ns : 1) / 1e9
+            mb_per_s = bytes / seconds / 1048576
+            cycles_per_byte = bytes > 0 ? seconds * ghz * 1e9 / bytes : 0
+            line = sprintf("{\"name\": %s, \"transformation\": %s, \"corpus\": \"%s\", \"bytes\": %d, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"cycles_per_byte\": %.3f",
+                json(ENVIRON["NAME"]), json(ENVIRON["TRANSFORMATION"]), corpus, bytes, seconds, mb_per_s, cycles_per_byte)
+            if (allocations != "") line = line sprintf(", \"allocations\": %d", allocations)
+            if (requests != "") line = line sprintf(", \"requests_per_s\": %d", requests / seconds)
+            print line "}" >> results
+            printf "%-20s %-8s %11d bytes %10.3f ms %10.2f MB/s %9.3f cycles/byte", ENVIRON["NAME"], corpus, bytes, seconds * 1000, mb_per_s, cycles_per_byte
+            if (requests != "") printf " %9d requests/s", requests / seconds
+            printf "\n"
+        }'
+}
+
+# Times a transformation on a file, keeping the fastest of the runs.
+bench() {
+    name=$1
+    transformation=$2
+    kind=$3
+    case $name in *"$filter"*) ;; *) return ;; esac
+    for size in $sizes; do
+        size=$(bytes "$size")
+        file=$(corpus "$kind" "$size")
+        best=""
+        i=0
+        while [ $i -lt "$runs" ]; do
+            start=$(now)
+            stats=$(./egg --stats "$transformation" < "$file" 2>&1 > /dev/null)
+            end=$(now)
+            if [ -z "$best" ] || [ $((end - start)) -lt "$best" ]; then
+                best=$((end - start))
+            fi
+            i=$((i + 1))
+        done
+        allocations=$(echo "$stats" | sed -n 's/.*, \([0-9]*\) while running/\1/p')
+        record "$name" "$transformation" "$kind" "$size" "$best" "$allocations"
+    done
+}
+
+# the cost of starting egg, which is most of the time taken for small inputs
+best=""
+for i in 1 2 3 4 5; do
+    start=$(now)
+    ./egg "." < /dev/null
+    end=$(now)
+    if [ -z "$best" ] || [ $((end - start)) -lt "$best" ]; then
+        best=$((end - start))
+    fi
+done
+record "startup" "." "empty" 0 "$best"
+
+for kind in $corpora; do
+    bench "u" "u" "$kind"
+    bench "s" "s" "$kind"
+    bench "r" "r" "$kind"
+    bench "b" "b" "$kind"
+    bench "h" "h" "$kind"
+    bench "c" "c" "$kind"
+    bench "replace" "{'the' = 'THE' 'ERROR' = 'E' ',' = ';'}" "$kind"
+    bench "x" "x'the'" "$kind"
+    bench "split" "|' 'r" "$kind"
+    bench "E" "Eu" "$kind"
+    bench "fixpoint" ":{'ss' = 's'}" "$kind"
+done
+case " $corpora " in *" binary "*) bench "B" "B" "base64" ;; esac
+for kind in $corpora; do
+    case $kind in binary) continue ;; esac
+    bench "leetify" "'leetify'" "$kind"
+    bench "case-chain" "u j i C" "$kind"
+    bench "lines" "|'\n'(t C)" "$kind"
+done
+
+# Short strings: starting egg for each of them, and sending them all to one egg with --batch or --serve.
+case requests in *"$filter"*)
+    requests=20000
+    yes '3:u C,19:the quick brown fox,' | head -n "$requests" | tr -d '\n' > "$scratch"
+    request_bytes=$((requests * 19))
+
+    start=$(now)
+    i=0
+    while [ $i -lt 1000 ]; do
+        echo "the quick brown fox" | ./egg "u C" > /dev/null
+        i=$((i + 1))
+    done
+    end=$(now)
+    record "requests-fork-exec" "u C" "requests" $((1000 * 19)) $((end - start)) "" 1000
+
+    start=$(now)
+    ./egg --batch < "$scratch" > /dev/null
+    end=$(now)
+    record "requests-batch" "u C" "requests" "$request_bytes" $((end - start)) "" "$requests"
+
+    socket=$(mktemp -u)
+    ./egg --serve "$socket" &
+    server=$!
+    while [ ! -S "$socket" ]; do sleep 0.01; done
+    start=$(now)
+    ./egg --connect "$socket" < "$scratch" > /dev/null
+    end=$(now)
+    kill $server
+    record "requests-serve" "u C" "requests" "$request_bytes" $((end - start)) "" "$requests"
+;; esac
+
+{
+    printf '{\n"commit": "%s",\n"cpu_ghz": %s,\n"results": [\n' "$(git rev-parse --short HEAD 2>/dev/null)" "$ghz"
+    sed '$!s/$/,/' "$results"
+    printf ']\n}\n'
+} > "$output"
+echo "Results written to $output"
+
+# Compares the times with the baseline, for the benchmarks both have run.
+if [ -n "$baseline" ]; then
+    awk -v threshold="$threshold" '
+        function field(line, key) {
+            if (!match(line, "\"" key "\": (\"[^\"]*\"|[0-9.]+)")) return ""
+            value = substr(line, RSTART + length(key) + 4, RLENGTH - length(key) - 4)
+            gsub(/"/, "", value)
+            return value
+        }
+        /"name"/ {
+            key = field($0, "name") " " field($0, "corpus") " " field($0, "bytes")
+            seconds = field($0, "seconds") + 0
+            if (FILENAME == ARGV[1]) {
+                before[key] = seconds
+            } else if (key in before && before[key] > 0 && seconds > 0) {
+                change = (before[key] / seconds - 1) * 100
+                printf "%-40s %10.3f -> %10.3f ms  %+7.1f%% speed\n", key, before[key] * 1000, seconds * 1000, change
+                if (change < -threshold) slower = slower "\n  " key
+            }
+        }
+        END {
+            if (slower != "") {
+                printf "Slower than the baseline by more than %s%%:%s\n", threshold, slower
+                exit 1
+            }
+        }' "$baseline" "$output"
+fi
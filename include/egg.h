@@ -0,0 +1,65 @@
+#ifndef EGG_H
+#define EGG_H
+
+// The egg text transformer as a library (libegg.a / libegg.so, built by `make`).
+//
+//     egg_program* program;
+//     if (egg_compile("|' '(C)", &program) != EGG_OK) {
+//         fprintf(stderr, "%s\n", egg_error_message());
+//     }
+//     egg_buffer out = {0};
+//     egg_run(program, "hello world", 11, &out); // out.data = "Hello World", out.len = 11
+//     egg_free_buffer(&out);
+//     egg_free_program(program);
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define EGG_API __attribute__((visibility("default")))
+#else
+#define EGG_API
+#endif
+
+// A compiled transformation. It is never changed after egg_compile, so any number of threads
+// can run the same program at once.
+typedef struct egg_program egg_program;
+
+// The output of egg_run. Start with an all-zero buffer; later runs reuse and grow it.
+// The output is not NUL-terminated.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t capacity;
+} egg_buffer;
+
+typedef enum {
+    EGG_OK = 0,
+    EGG_ERROR_ARGUMENT, // a required pointer was NULL
+    EGG_ERROR_COMPILE,  // the transformation is invalid, or a basket it uses could not be found or read
+    EGG_ERROR_RUN,      // the input is not valid for the transformation, e.g. malformed base64 for 'B'
+    EGG_ERROR_MEMORY,   // an allocation failed
+} egg_status;
+
+// Compiles a transformation, as given on the egg command line, into `*program`.
+// Baskets are looked up like the command line tool does and are compiled once per process.
+EGG_API egg_status egg_compile(const char* transformation, egg_program** program);
+
+// Transforms `len` bytes of `input` and puts the result into `out`, replacing what it held.
+// After an error `out` is empty.
+EGG_API egg_status egg_run(const egg_program* program, const char* input, size_t len, egg_buffer* out);
+
+EGG_API void egg_free_program(egg_program* program);
+EGG_API void egg_free_buffer(egg_buffer* buffer);
+
+// Describes the last error returned to the calling thread.
+EGG_API const char* egg_error_message(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // EGG_H
@@ -1,5 +1,7 @@
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS
+#else
+#define _GNU_SOURCE // madvise, splice
 #endif
 
 #include <stdio.h>
@@ -7,14 +9,36 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <direct.h>
+#include <io.h>
 #define getcwd _getcwd
+#define read _read
+#define write _write
+#define STDIN_FILENO 0
+#define STDOUT_FILENO 1
 #else
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+// SSE2 is part of x86-64, AVX2 is picked at runtime. Build with -DEGG_NO_SIMD to use the scalar loops only.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(EGG_NO_SIMD)
+#define EGG_SIMD_X86 1
+#include <immintrin.h>
 #endif
 
 #define assert(condition) assert_msg(condition, #condition)
@@ -23,24 +47,81 @@
 #define assert_msg(x, message) _assert_msgf((x), __FILE__ ":" _to_string(__LINE__) ": Assertion failed: %s\n", (message))
 #define assert_msgf(x, message, ...) _assert_msgf((x), __FILE__ ":" _to_string(__LINE__) ": Assertion failed: " message "\n", __VA_ARGS__)
 
+#if defined(__GNUC__) || defined(__clang__)
+#define EGG_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define EGG_THREAD_LOCAL __declspec(thread)
+#endif
+
+#include <setjmp.h>
+
+// While error_jump is set, a failed assertion jumps to it instead of exiting, keeping the message
+// in error_message. The library uses this to return errors, and --serve to answer with them.
+EGG_THREAD_LOCAL jmp_buf* error_jump = NULL;
+EGG_THREAD_LOCAL char error_message[512];
+
+#ifdef EGG_LIBRARY
+#include "egg.h"
+
+EGG_THREAD_LOCAL bool allocation_failed = false;
+#endif
+
 void _assert_msgf(bool x, const char* format, ...) {
     if (!x) {
         va_list args;
         va_start(args, format);
+        if (error_jump) {
+            vsnprintf(error_message, sizeof(error_message), format, args);
+            va_end(args);
+            longjmp(*error_jump, 1);
+        }
         vfprintf(stderr, format, args);
         va_end(args);
         exit(EXIT_FAILURE);
     }
 }
 
+// Number of calls to malloc_or_die and realloc_or_die, reported by --stats,
+// and those made by the calling thread, for --profile.
+size_t allocation_count = 0;
+EGG_THREAD_LOCAL size_t thread_allocation_count = 0;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define atomic_add(target, value) __atomic_fetch_add(&(target), (value), __ATOMIC_RELAXED)
+#else
+#define atomic_add(target, value) ((target) += (value))
+#endif
+#define count_allocation() (atomic_add(allocation_count, 1), thread_allocation_count++)
+
+#ifdef EGG_LIBRARY
+#define note_allocation_failure(ptr) do { if (!(ptr)) allocation_failed = true; } while (0)
+#else
+#define note_allocation_failure(ptr) ((void) 0)
+#endif
+
+// The message of the last caught assertion, without its "file:line: Assertion failed: " and newline.
+const char* error_text(void) {
+    const char* message = strstr(error_message, "Assertion failed: ");
+    message = message ? message + strlen("Assertion failed: ") : error_message;
+    size_t len = strlen(message);
+    if (len > 0 && message[len - 1] == '\n') {
+        error_message[message - error_message + len - 1] = '\0';
+    }
+    return message;
+}
+
 void* malloc_or_die(size_t size) {
+    count_allocation();
     void* ptr = malloc(size);
+    note_allocation_failure(ptr);
     assert_msg(ptr != NULL, "Memory allocation failed");
     return ptr;
 }
 
 void* realloc_or_die(void* ptr, size_t size) {
+    count_allocation();
     void* new_ptr = realloc(ptr, size);
+    note_allocation_failure(new_ptr);
     assert_msg(new_ptr != NULL, "Memory reallocation failed");
     return new_ptr;
 }
@@ -70,10 +151,104 @@ void free_and_replace(void* ptr, void* new_ptr) {
     *(void**) ptr = new_ptr;
 }
 
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+// A bump allocator for short-lived buffers. Memory is handed out from large blocks and
+// given back all at once by resetting to an earlier mark; the blocks are kept for reuse
+// until arena_free.
+typedef struct {
+    ArenaBlock* first;
+    ArenaBlock* current;
+} Arena;
+
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    ArenaBlock* block = arena->current;
+    if (block && block->capacity - block->used >= size) {
+        void* ptr = block->data + block->used;
+        block->used += size;
+        return ptr;
+    }
+
+    ArenaBlock* next = block ? block->next : arena->first;
+    if (!next || next->capacity < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* new_block = malloc_or_die(sizeof(ArenaBlock) + capacity);
+        new_block->capacity = capacity;
+        new_block->next = next;
+        if (block) {
+            block->next = new_block;
+        } else {
+            arena->first = new_block;
+        }
+        next = new_block;
+    }
+    next->used = size;
+    arena->current = next;
+    return next->data;
+}
+
+// Grows an allocation, in place if it is the last one made from the current block.
+void* arena_realloc(Arena* arena, void* ptr, size_t old_size, size_t new_size) {
+    ArenaBlock* block = arena->current;
+    if (ptr && block) {
+        size_t offset = (char*) ptr - block->data;
+        size_t aligned_old_size = (old_size + 15) & ~(size_t) 15;
+        if ((char*) ptr >= block->data && offset + aligned_old_size == block->used && offset + new_size <= block->capacity) {
+            block->used = offset + ((new_size + 15) & ~(size_t) 15);
+            return ptr;
+        }
+    }
+    void* new_ptr = arena_alloc(arena, new_size);
+    if (ptr && old_size > 0) {
+        memcpy(new_ptr, ptr, old_size);
+    }
+    return new_ptr;
+}
+
+ArenaMark arena_mark(const Arena* arena) {
+    return (ArenaMark) {
+        .block = arena->current,
+        .used = arena->current ? arena->current->used : 0,
+    };
+}
+
+// Releases everything allocated since `mark` was taken.
+void arena_reset(Arena* arena, ArenaMark mark) {
+    arena->current = mark.block;
+    if (mark.block) {
+        mark.block->used = mark.used;
+    }
+}
+
+void arena_free(Arena* arena) {
+    ArenaBlock* block = arena->first;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
 typedef struct {
     char *items;
     size_t count;
     size_t capacity;
+    Arena* arena; // if set, the buffer is allocated from (and released with) this arena
 } String;
 
 #define String_reserve(da, expected_capacity)                                                     \
@@ -81,6 +256,7 @@ typedef struct {
     {                                                                                         \
         if ((expected_capacity) > (da)->capacity)                                             \
         {                                                                                     \
+            size_t old_capacity = (da)->items ? (da)->capacity : 0;                           \
             if ((da)->capacity == 0)                                                          \
             {                                                                                 \
                 (da)->capacity = 256;                                                         \
@@ -89,7 +265,14 @@ typedef struct {
             {                                                                                 \
                 (da)->capacity *= 2;                                                          \
             }                                                                                 \
-            (da)->items = realloc_or_die((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+            if ((da)->arena)                                                                  \
+            {                                                                                 \
+                (da)->items = arena_realloc((da)->arena, (da)->items, old_capacity, (da)->capacity); \
+            }                                                                                 \
+            else                                                                              \
+            {                                                                                 \
+                (da)->items = realloc_or_die((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+            }                                                                                 \
         }                                                                                     \
     } while (0)
 
@@ -105,9 +288,12 @@ typedef struct {
 #define String_appendMany(da, new_items, new_items_count)                                            \
     do                                                                                            \
     {                                                                                             \
-        String_reserve((da), (da)->count + (new_items_count));                                        \
-        memcpy((da)->items + (da)->count, (new_items), (new_items_count) * sizeof(*(da)->items)); \
-        (da)->count += (new_items_count);                                                         \
+        if ((new_items_count) > 0)                                                                \
+        {                                                                                         \
+            String_reserve((da), (da)->count + (new_items_count));                                    \
+            memcpy((da)->items + (da)->count, (new_items), (new_items_count) * sizeof(*(da)->items)); \
+            (da)->count += (new_items_count);                                                     \
+        }                                                                                         \
     } while (0)
 
 #define String_appendCStr(str, cstr)  \
@@ -152,6 +338,88 @@ typedef struct {
 
 #define StringList_free(str) free_or_die(&(str).items)
 
+#define List_reserve(da, expected_capacity)                                                       \
+    do                                                                                        \
+    {                                                                                         \
+        if ((expected_capacity) > (da)->capacity)                                             \
+        {                                                                                     \
+            if ((da)->capacity == 0)                                                          \
+            {                                                                                 \
+                (da)->capacity = 4;                                                           \
+            }                                                                                 \
+            while ((expected_capacity) > (da)->capacity)                                      \
+            {                                                                                 \
+                (da)->capacity *= 2;                                                          \
+            }                                                                                 \
+            (da)->items = realloc_or_die((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+        }                                                                                     \
+    } while (0)
+
+#define List_append(da, item)                  \
+    do                                       \
+    {                                        \
+        List_reserve((da), (da)->count + 1);     \
+        (da)->items[(da)->count++] = (item); \
+    } while (0)
+
+typedef struct Node Node;
+
+// A compiled transformation: the nodes are executed in order on the input.
+typedef struct {
+    Node* items;
+    size_t count;
+    size_t capacity;
+    bool in_place; // no node ever grows the string, see run_program_on
+    bool shared;   // a basket owned by the basket cache, see load_basket
+} Program;
+
+typedef struct {
+    Program* items;
+    size_t count;
+    size_t capacity;
+} ProgramList;
+
+typedef struct {
+    String from;
+    String to;
+} ReplaceRule;
+
+// Finds the longest rule whose 'from' starts at a given position: an Aho-Corasick automaton
+// with a dense transition table over byte classes, or just a byte table when no 'from' is
+// longer than one byte.
+typedef struct {
+    size_t longest;                // length of the longest 'from'
+    int empty_rule;                // rule with an empty 'from', used where no other rule matches, or -1
+    int byte_rule[256];            // longest <= 1: the rule for every byte, or -1
+    unsigned char byte_class[256]; // bytes that occur in no 'from' share class 0
+    size_t class_count;
+    size_t state_count;
+    int* next;                     // state_count * class_count transitions, state 0 is the root
+    int* rule;                     // rule ending in each state, or -1
+    int* output;                   // closest state on the failure chain that ends a rule, or -1
+} Matcher;
+
+typedef struct {
+    ReplaceRule* items;
+    size_t count;
+    size_t capacity;
+    Matcher matcher;
+} ReplaceRules;
+
+// Not written by users: consecutive nodes that each replace every byte by one byte, fused into
+// a single table by fuse_byte_maps.
+#define OP_BYTE_MAP '#'
+
+struct Node {
+    char op;             // the transformation character, e.g. 'u' or '{'
+    String str;          // 'a', 'p', 'x', '|': string argument, '\'': NUL-terminated basket file path, '#': 256 byte table
+    size_t number;       // 'L': length limit, '@': character index, '\'': hash of the basket text, '#': nodes fused
+    Program body;        // 'E', '@', ':', '|', '\'': nested transformation
+    ProgramList windows; // '[': one transformation per character position
+    ReplaceRules rules;  // '{': replacement rules, longest 'from' first, and their matcher
+    struct NodeProfile* profile; // what --profile measured, see attach_profiles
+};
+
 const char unescaped_chars[] = {
     [0] = 0,
     ['n'] = '\n',
@@ -168,6 +436,21 @@ const char unescaped_chars[] = {
     ['x'] = 0 // 'x' is used for hex escape sequences
 };
 
+// Inverse of unescaped_chars: the character to put after a '\' to escape a byte, or 0.
+const char escaped_chars[256] = {
+    ['\0'] = '0',
+    ['\n'] = 'n',
+    ['\t'] = 't',
+    ['\r'] = 'r',
+    ['\b'] = 'b',
+    ['\f'] = 'f',
+    ['\v'] = 'v',
+    ['\a'] = 'a',
+    ['\\'] = '\\',
+    ['\''] = '\'',
+    ['\"'] = '\"',
+};
+
 char* duplicate_string(const char* str) {
     assert(str != NULL);
 
@@ -177,6 +460,16 @@ char* duplicate_string(const char* str) {
     return result;
 }
 
+// Frees the buffer of `str`, if it has one. Buffers from an arena are released with the arena.
+void free_string(String* str) {
+    if (str->items && !str->arena) {
+        free_or_die(&str->items);
+    }
+    str->items = NULL;
+    str->count = 0;
+    str->capacity = 0;
+}
+
 static inline bool isUpper(char c) {
     return (c >= 'A' && c <= 'Z');
 }
@@ -201,1082 +494,4622 @@ static inline char toLower(char c) {
     return isUpper(c) ? c + ('a' - 'A') : c;
 }
 
-char* tf_upper(char* input) {
-    assert(input != NULL);
+// Vector kernels for the byte-wise operators. Each one handles a prefix of whole
+// blocks and returns how many bytes it consumed; the caller finishes the tail with
+// the scalar loop. Without SIMD support they consume nothing.
+
+#ifdef EGG_SIMD_X86
+enum {
+    CPU_AVX2 = 1 << 0,
+    CPU_SSE42 = 1 << 1,
+    CPU_PCLMUL = 1 << 2,
+};
 
-    for (size_t i = 0; input[i]; ++i) {
-        input[i] = toUpper(input[i]);
+// The features are detected on first use, possibly by several threads at once, which all store the same value.
+static bool cpu_has(int feature) {
+    static int detected = -1;
+    int features = __atomic_load_n(&detected, __ATOMIC_RELAXED);
+    if (features < 0) {
+        __builtin_cpu_init();
+        features = (__builtin_cpu_supports("avx2") ? CPU_AVX2 : 0)
+                 | (__builtin_cpu_supports("sse4.2") ? CPU_SSE42 : 0)
+                 | (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1") ? CPU_PCLMUL : 0);
+        __atomic_store_n(&detected, features, __ATOMIC_RELAXED);
     }
-    return duplicate_string(input);
+    return (features & feature) != 0;
 }
-char* tf_lower(char* input) {
-    assert(input != NULL);
 
-    for (size_t i = 0; input[i]; ++i) {
-        input[i] = toLower(input[i]);
+// Flips bit 0x20 of every byte b with lo <= (b | fold) <= hi.
+// Signed compares are fine: lo and hi are ASCII letters, non-ASCII bytes are negative.
+static size_t sse2_flip_case(char* s, size_t n, char fold, char lo, char hi) {
+    const __m128i vfold = _mm_set1_epi8(fold);
+    const __m128i vlo = _mm_set1_epi8(lo - 1);
+    const __m128i vhi = _mm_set1_epi8(hi + 1);
+    const __m128i bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i f = _mm_or_si128(v, vfold);
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi8(f, vlo), _mm_cmplt_epi8(f, vhi));
+        _mm_storeu_si128((__m128i*) (s + i), _mm_xor_si128(v, _mm_and_si128(in, bit)));
     }
-    return duplicate_string(input);
+    return i;
 }
-char* tf_reverse(char* input) {
-    assert(input != NULL);
 
-    size_t len = strlen(input);
-    for (size_t i = 0; i < len / 2; ++i) {
-        char temp = input[i];
-        input[i] = input[len - i - 1];
-        input[len - i - 1] = temp;
+// ' ' or '\t' ... '\r', same as isSpace.
+static inline __m128i sse2_space_mask(__m128i v) {
+    __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+    return _mm_or_si128(ctrl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+static size_t sse2_join(char* s, size_t n) {
+    const __m128i underscore = _mm_set1_epi8('_');
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i m = sse2_space_mask(v);
+        _mm_storeu_si128((__m128i*) (s + i), _mm_or_si128(_mm_andnot_si128(m, v), _mm_and_si128(m, underscore)));
     }
-    input[len] = '\0';
-    return duplicate_string(input);
+    return i;
 }
-char* tf_capitalize(char* input) {
-    assert(input != NULL);
 
-    bool capitalize_next = true;
-    for (size_t i = 0; input[i]; ++i) {
-        if (isSpace(input[i])) {
-            capitalize_next = true;
-        } else if (capitalize_next) {
-            input[i] = toUpper(input[i]);
-            capitalize_next = false;
+// Moves whole blocks without whitespace down to *k, skips blocks of only whitespace
+// and compacts mixed blocks byte by byte.
+static size_t sse2_strip(char* s, size_t n, size_t* k) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(sse2_space_mask(v));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i*) (s + *k), v);
+            *k += 16;
+        } else if (mask != 0xFFFF) {
+            for (size_t j = 0; j < 16; ++j) {
+                if (!(mask & (1u << j))) s[(*k)++] = s[i + j];
+            }
         }
     }
-    return duplicate_string(input);
+    return i;
 }
-char* tf_decapitalize(char* input) {
-    assert(input != NULL);
-    
-    bool decapitalize_next = true;
-    for (size_t i = 0; input[i]; ++i) {
-        if (isSpace(input[i])) {
-            decapitalize_next = true;
-        } else if (decapitalize_next) {
-            input[i] = toLower(input[i]);
-            decapitalize_next = false;
+
+static size_t sse2_remove_byte(const char* in, size_t n, char c, char* out, size_t* k) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i*) (out + *k), v);
+            *k += 16;
+        } else if (mask != 0xFFFF) {
+            for (size_t j = 0; j < 16; ++j) {
+                if (!(mask & (1u << j))) out[(*k)++] = in[i + j];
+            }
         }
     }
-    return duplicate_string(input);
+    return i;
 }
-char* tf_duplicate(char* input) {
-    assert(input != NULL);
 
-    size_t len = strlen(input);
-    char* result = malloc_or_die(len * 2 + 1);
-    strcpy(result, input);
-    strcat(result, input);
-    return result;
+static size_t sse2_find(const char* s, size_t n, const char* needle, size_t m, bool* found) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (s + i + m - 1));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + (size_t) __builtin_ctz(mask);
+            if (memcmp(s + at + 1, needle + 1, m - 2) == 0) {
+                *found = true;
+                return at;
+            }
+        }
+    }
+    return i;
 }
-char* tf_strip(char* input) {
-    assert(input != NULL);
 
-    size_t nonSpaceChars = 0;
-    for (size_t i = 0; input[i]; ++i) {
-        if (!isSpace(input[i])) {
-            nonSpaceChars++;
-        }
+// Number of leading whitespace bytes, counted in whole blocks.
+static size_t sse2_skip_space(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        if (_mm_movemask_epi8(sse2_space_mask(v)) != 0xFFFF) break;
     }
-    size_t len = strlen(input);
-    char* result = malloc_or_die(nonSpaceChars + 1);
-    size_t k = 0;
-    for (size_t i = 0; i < len && k < nonSpaceChars; ++i) {
-        if (!isSpace(input[i])) {
-            result[k++] = input[i];
-        }
+    return i;
+}
+
+// Number of trailing whitespace bytes, counted in whole blocks.
+static size_t sse2_skip_space_back(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + n - i - 16));
+        if (_mm_movemask_epi8(sse2_space_mask(v)) != 0xFFFF) break;
     }
-    result[k] = '\0';
-    result = realloc(result, k + 1);
-    return result;
+    return i;
 }
-char* tf_trim(char* input) {
-    assert(input != NULL);
 
-    size_t start = 0;
-    while (isSpace(input[start])) {
-        ++start;
+static inline __m128i sse2_in_range(__m128i v, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static size_t sse2_hex_encode(const unsigned char* in, size_t len, bool upper, char* out) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letter = _mm_set1_epi8((upper ? 'A' : 'a') - '0' - 10);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+        __m128i low = _mm_and_si128(v, nibble);
+        high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letter));
+        low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letter));
+        _mm_storeu_si128((__m128i*) (out + 2 * i), _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*) (out + 2 * i + 16), _mm_unpackhi_epi8(high, low));
     }
-    size_t end = strlen(input);
-    while (end > start && isSpace(input[end - 1])) {
-        --end;
+    return i;
+}
+
+// Digit values of 16 hex characters; the returned mask marks the ones that are digits.
+static inline __m128i sse2_hex_values(__m128i c, __m128i* values) {
+    __m128i digit = sse2_in_range(c, '0', '9');
+    __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i letter = sse2_in_range(folded, 'a', 'f');
+    *values = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                           _mm_and_si128(letter, _mm_sub_epi8(folded, _mm_set1_epi8('a' - 10))));
+    return _mm_or_si128(digit, letter);
+}
+
+// Stops at the first block of 32 that contains anything but hex digits.
+static size_t sse2_hex_decode(const unsigned char* in, size_t len, char* out) {
+    const __m128i low_byte = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m128i a, b;
+        __m128i valid = _mm_and_si128(sse2_hex_values(_mm_loadu_si128((const __m128i*) (in + i)), &a),
+                                      sse2_hex_values(_mm_loadu_si128((const __m128i*) (in + i + 16)), &b));
+        if (_mm_movemask_epi8(valid) != 0xFFFF) break;
+        // Each 16-bit lane holds a pair of digits, the high nibble in its low byte.
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low_byte), 4), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, low_byte), 4), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i*) (out + i / 2), _mm_packus_epi16(a, b));
     }
-    size_t len = end - start;
-    char* result = malloc_or_die(len + 1);
-    strncpy(result, input + start, len);
-    result[len] = '\0';
-    return result;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_flip_case(char* s, size_t n, char fold, char lo, char hi) {
+    const __m256i vfold = _mm256_set1_epi8(fold);
+    const __m256i vlo = _mm256_set1_epi8(lo - 1);
+    const __m256i vhi = _mm256_set1_epi8(hi + 1);
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i f = _mm256_or_si256(v, vfold);
+        __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(f, vlo), _mm256_cmpgt_epi8(vhi, f));
+        _mm256_storeu_si256((__m256i*) (s + i), _mm256_xor_si256(v, _mm256_and_si256(in, bit)));
+    }
+    return i;
 }
-char* tf_join(char* input) {
-    assert(input != NULL);
 
-    for (size_t i = 0; input[i]; ++i) {
-        if (isSpace(input[i])) {
-            input[i] = '_';
+__attribute__((target("avx2")))
+static inline __m256i avx2_space_mask(__m256i v) {
+    __m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+    return _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_join(char* s, size_t n) {
+    const __m256i underscore = _mm256_set1_epi8('_');
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        _mm256_storeu_si256((__m256i*) (s + i), _mm256_blendv_epi8(v, underscore, avx2_space_mask(v)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_strip(char* s, size_t n, size_t* k) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(avx2_space_mask(v));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i*) (s + *k), v);
+            *k += 32;
+        } else if (mask != 0xFFFFFFFFu) {
+            for (size_t j = 0; j < 32; ++j) {
+                if (!(mask & (1u << j))) s[(*k)++] = s[i + j];
+            }
         }
     }
-    return duplicate_string(input);
+    return i;
 }
-char* tf_escape(char* input) {
-    assert(input != NULL);
 
-    size_t len = strlen(input);
-    char* result = malloc_or_die(len * 2 + 1);
-    size_t k = 0;
-    for (size_t i = 0; input[i]; ++i) {
-        for (size_t j = 0; j < sizeof(unescaped_chars); ++j) {
-            if (input[i] == unescaped_chars[j]) {
-                result[k++] = '\\';
-                result[k++] = j;
-                goto escape_outer;
+__attribute__((target("avx2")))
+static size_t avx2_remove_byte(const char* in, size_t n, char c, char* out, size_t* k) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (in + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i*) (out + *k), v);
+            *k += 32;
+        } else if (mask != 0xFFFFFFFFu) {
+            for (size_t j = 0; j < 32; ++j) {
+                if (!(mask & (1u << j))) out[(*k)++] = in[i + j];
             }
         }
-        result[k++] = input[i];
-    escape_outer: (void)0;
     }
-    result[k] = '\0';
-    result = realloc(result, k + 1);
-    return result;
+    return i;
 }
-char* tf_unescape(char* input) {
-    assert(input != NULL);
 
-    size_t len = strlen(input);
-    char* result = malloc_or_die(len + 1);
-    size_t k = 0;
-    for (size_t i = 0; input[i]; ++i) {
-        if (input[i] == '\\') {
-            i++;
-            result[k++] = unescaped_chars[(int) input[i]];
-            if (input[i] == 'x') {
-                i++;
-                char hex[3] = {0};
-                hex[0] = input[i++];
-                hex[1] = input[i];
-                int value = (int)strtol(hex, NULL, 16);
-                result[k++] = (char)value;
+// Compares the first and last byte of the needle at 32 positions at once and checks the
+// candidates with memcmp. Returns the first match, or how far no match can start.
+__attribute__((target("avx2")))
+static size_t avx2_find(const char* s, size_t n, const char* needle, size_t m, bool* found) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + m - 1));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + (size_t) __builtin_ctz(mask);
+            if (memcmp(s + at + 1, needle + 1, m - 2) == 0) {
+                *found = true;
+                return at;
             }
-        } else {
-            result[k++] = input[i];
         }
     }
-    result[k] = '\0';
-    result = realloc(result, k + 1);
-    return result;
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_base64_encode(const unsigned char* in, size_t len, char c62, char c63, char* out) {
+    // Spreads each group of three bytes over a 32-bit lane as b1 b0 b2 b1, so that the four
+    // 6-bit fields can be moved into separate bytes with two multiplications.
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                             1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    size_t i = 0;
+    for (; i + 28 <= len; i += 24, out += 32) {
+        __m128i lo = _mm_loadu_si128((const __m128i*) (in + i));
+        __m128i hi = _mm_loadu_si128((const __m128i*) (in + i + 12));
+        __m256i v = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuffle);
+        __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040));
+        __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(t0, t1);
+        __m256i off = _mm256_set1_epi8('A');
+        off = _mm256_blendv_epi8(off, _mm256_set1_epi8('a' - 26), _mm256_cmpgt_epi8(idx, _mm256_set1_epi8(25)));
+        off = _mm256_blendv_epi8(off, _mm256_set1_epi8('0' - 52), _mm256_cmpgt_epi8(idx, _mm256_set1_epi8(51)));
+        off = _mm256_blendv_epi8(off, _mm256_set1_epi8((char) (c62 - 62)), _mm256_cmpeq_epi8(idx, _mm256_set1_epi8(62)));
+        off = _mm256_blendv_epi8(off, _mm256_set1_epi8((char) (c63 - 63)), _mm256_cmpeq_epi8(idx, _mm256_set1_epi8(63)));
+        _mm256_storeu_si256((__m256i*) out, _mm256_add_epi8(idx, off));
+    }
+    return i;
 }
-char* tf_drop(char* input) {
-    assert(input != NULL);
 
-    size_t len = strlen(input);
-    input[len - 1] = '\0';
-    return duplicate_string(input);
+__attribute__((target("avx2")))
+static inline __m256i avx2_in_range(__m256i v, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(lo - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), v));
 }
 
-char* tf_base64_encode(char* input) {
-    assert(input != NULL);
+// Stops at the first block of 32 that contains anything but digits, including whitespace and padding.
+__attribute__((target("avx2")))
+static size_t avx2_base64_decode(const unsigned char* in, size_t len, char c62, char c63, char* out) {
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                             2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32, out += 24) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (in + i));
+        __m256i upper = avx2_in_range(v, 'A', 'Z');
+        __m256i lower = avx2_in_range(v, 'a', 'z');
+        __m256i digit = avx2_in_range(v, '0', '9');
+        __m256i is62 = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c62));
+        __m256i is63 = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c63));
+        __m256i valid = _mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(digit, _mm256_or_si256(is62, is63)));
+        if (_mm256_movemask_epi8(valid) != -1) break;
 
-    size_t len = strlen(input);
-    String result = {0};
+        __m256i off = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+        off = _mm256_or_si256(off, _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+        off = _mm256_or_si256(off, _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+        off = _mm256_or_si256(off, _mm256_and_si256(is62, _mm256_set1_epi8((char) (62 - c62))));
+        off = _mm256_or_si256(off, _mm256_and_si256(is63, _mm256_set1_epi8((char) (63 - c63))));
+        __m256i values = _mm256_add_epi8(v, off);
 
-    const char* base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    for (size_t i = 0; i < len; i += 3) {
-        int a = input[i];
-        int b = (i + 1 < len) ? input[i + 1] : 0;
-        int c = (i + 2 < len) ? input[i + 2] : 0;
-        String_appendChar(&result, base64_chars[(a >> 2) & 0x3F]);
-        String_appendChar(&result, base64_chars[((a & 0x03) << 4) | ((b >> 4) & 0x0F)]);
-        String_appendChar(&result, (i + 1 < len) ? base64_chars[((b & 0x0F) << 2) | ((c >> 6) & 0x03)] : '=');
-        String_appendChar(&result, (i + 2 < len) ? base64_chars[c & 0x3F] : '=');
+        // 4 x 6 bits -> 2 x 12 bits -> 24 bits per lane, then keep the three low bytes of each lane in order.
+        __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, shuffle);
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256((__m256i*) out, merged);
     }
-    String_appendTerminator(&result);
-    
-    return result.items;
+    return i;
 }
 
-char* tf_base64_decode(char* input) {
-    assert(input != NULL);
-
-    size_t len = strlen(input);
-    if (len % 4 != 0) {
-        return ""; // Invalid base64 input, return empty string
+// Replaces every byte b by table[b]. The table is looked up in rows of 16 with a shuffle by the
+// low nibble, and each row that changes something is blended in where the high nibble selects it.
+__attribute__((target("avx2")))
+static size_t avx2_byte_map(unsigned char* s, size_t n, const unsigned char* table) {
+    if (n < 32) return 0;
+    __m256i rows[16];
+    __m256i row_nibbles[16];
+    int row_count = 0;
+    for (int h = 0; h < 16; ++h) {
+        bool identity = true;
+        for (int c = 0; c < 16; ++c) {
+            identity = identity && table[h * 16 + c] == h * 16 + c;
+        }
+        if (!identity) {
+            rows[row_count] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) (table + h * 16)));
+            row_nibbles[row_count++] = _mm256_set1_epi8((char) h);
+        }
     }
-    String result = {0};
-
-    const char* base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    for (size_t i = 0; i < len; i += 4) {
-        int a = strchr(base64_chars, input[i]) - base64_chars;
-        int b = strchr(base64_chars, input[i + 1]) - base64_chars;
-        int c = strchr(base64_chars, input[i + 2]) - base64_chars;
-        int d = strchr(base64_chars, input[i + 3]) - base64_chars;
-
-        String_appendChar(&result, (a << 2) | (b >> 4));
-        if (input[i + 2] != '=') {
-            String_appendChar(&result, ((b & 0x0F) << 4) | (c >> 2));
-            if (input[i + 3] != '=') {
-                String_appendChar(&result, ((c & 0x03) << 6) | d);
-            }
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i low = _mm256_and_si256(v, nibble);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+        __m256i mapped = v;
+        for (int k = 0; k < row_count; ++k) {
+            mapped = _mm256_blendv_epi8(mapped, _mm256_shuffle_epi8(rows[k], low), _mm256_cmpeq_epi8(high, row_nibbles[k]));
         }
+        _mm256_storeu_si256((__m256i*) (s + i), mapped);
     }
-    String_appendTerminator(&result);
-    
-    return result.items;
+    return i;
 }
+#endif
 
-char* tf_hex_encode(char* input) {
-    assert(input != NULL);
+static size_t simd_flip_case(char* s, size_t n, char fold, char lo, char hi) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_flip_case(s, n, fold, lo, hi);
+    return sse2_flip_case(s, n, fold, lo, hi);
+#else
+    (void) s; (void) n; (void) fold; (void) lo; (void) hi;
+    return 0;
+#endif
+}
 
-    size_t len = strlen(input);
-    char* result = malloc_or_die(len * 2 + 1);
-    for (size_t i = 0; i < len; ++i) {
-        char hex[3];
-        snprintf(hex, sizeof(hex), "%02x", (unsigned char)input[i]);
-        result[i * 2] = hex[0];
-        result[i * 2 + 1] = hex[1];
-    }
-    result[len * 2] = '\0';
-    return result;
+static size_t simd_byte_map(unsigned char* s, size_t n, const unsigned char* table) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_byte_map(s, n, table);
+#else
+    (void) s; (void) n; (void) table;
+#endif
+    return 0;
 }
 
-char* tf_hex_decode(char* input) {
-    assert(input != NULL);
+static size_t simd_join(char* s, size_t n) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_join(s, n);
+    return sse2_join(s, n);
+#else
+    (void) s; (void) n;
+    return 0;
+#endif
+}
 
-    size_t len = strlen(input);
-    if (len % 2 != 0) {
-        return ""; // Invalid hex input, return empty string
-    }
-    char* result = malloc_or_die(len / 2 + 1);
-    for (size_t i = 0; i < len; i += 2) {
-        sscanf(input + i, "%2hhx", &result[i / 2]);
-    }
-    result[len / 2] = '\0';
-    return result;
+static size_t simd_strip(char* s, size_t n, size_t* k) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_strip(s, n, k);
+    return sse2_strip(s, n, k);
+#else
+    (void) s; (void) n; (void) k;
+    return 0;
+#endif
 }
 
-char* tf_xor_cipher(char* input) {
-    assert(input != NULL);
-
-    size_t len = strlen(input);
-    for (size_t i = 0; i < len; ++i) {
-        input[i] ^= 0xFF; // simple XOR obfuscation
-    }
-    return tf_hex_encode(input);
-}
-
-static const unsigned int crc_table[256] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba,
-    0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
-    0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-    0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
-    0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de,
-    0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-    0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,
-    0x14015c4f, 0x63066cd9, 0xfa0f3d63, 0x8d080df5,
-    0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-    0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,
-    0x35b5a8fa, 0x42b2986c, 0xdbbbc9d6, 0xacbcf940,
-    0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-    0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116,
-    0x21b4f4b5, 0x56b3c423, 0xcfba9599, 0xb8bda50f,
-    0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-    0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,
-    0x76dc4190, 0x01db7106, 0x98d220bc, 0xefd5102a,
-    0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-    0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818,
-    0x7f6a0dbb, 0x086d3d2d, 0x91646c97, 0xe6635c01,
-    0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-    0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457,
-    0x65b0d9c6, 0x12b7e950, 0x8bbeb8ea, 0xfcb9887c,
-    0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-    0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2,
-    0x4adfa541, 0x3dd895d7, 0xa4d1c46d, 0xd3d6f4fb,
-    0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-    0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9,
-    0x5005713c, 0x270241aa, 0xbe0b1010, 0xc90c2086,
-    0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-    0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4,
-    0x59b33d17, 0x2eb40d81, 0xb7bd5c3b, 0xc0ba6cad,
-    0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-    0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683,
-    0xe3630b12, 0x94643b84, 0x0d6d6a3e, 0x7a6a5aa8,
-    0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-    0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe,
-    0xf762575d, 0x806567cb, 0x196c3671, 0x6e6b06e7,
-    0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-    0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5,
-    0xd6d6a3e8, 0xa1d1937e, 0x38d8c2c4, 0x4fdff252,
-    0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-    0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60,
-    0xdf60efc3, 0xa867df55, 0x316e8eef, 0x4669be79,
-    0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-    0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f,
-    0xc5ba3bbe, 0xb2bd0b28, 0x2bb45a92, 0x5cb36a04,
-    0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-    0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a,
-    0x9c0906a9, 0xeb0e363f, 0x72076785, 0x05005713,
-    0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-    0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21,
-    0x86d3d2d4, 0xf1d4e242, 0x68ddb3f8, 0x1fda836e,
-    0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-    0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c,
-    0x8f659eff, 0xf862ae69, 0x616bffd3, 0x166ccf45,
-    0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-    0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db,
-    0xaed16a4a, 0xd9d65adc, 0x40df0b66, 0x37d83bf0,
-    0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-    0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6,
-    0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
-    0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-    0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-};
+// Base64 encodes whole blocks of 24 bytes from `in` to `out` and returns how many bytes were encoded.
+static size_t simd_base64_encode(const unsigned char* in, size_t len, char c62, char c63, char* out) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_base64_encode(in, len, c62, c63, out);
+#endif
+    (void) in; (void) len; (void) c62; (void) c63; (void) out;
+    return 0;
+}
 
-#define DO1(buf) crc = crc_table[((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
-#define DO2(buf)  DO1(buf); DO1(buf);
-#define DO4(buf)  DO2(buf); DO2(buf);
-#define DO8(buf)  DO4(buf); DO4(buf);
-
-unsigned int crc32(const unsigned char *buffer, unsigned int len) {
-	unsigned int crc;
-	crc = 0;
-	crc = crc ^ 0xffffffffL;
-	while(len >= 8) {
-		DO8(buffer);
-		len -= 8;
-	}
-	if(len) do {
-		DO1(buffer);
-	} while(--len);
-	return crc ^ 0xffffffffL;
-}
-
-#undef DO1
-#undef DO2
-#undef DO4
-#undef DO8
-
-char* tf_crc32(char* input) {
-    assert(input != NULL);
-
-    unsigned int crc = crc32((unsigned char*)input, strlen(input));
-    char* result = malloc_or_die(9);
-    sprintf(result, "%08x", crc);
-    return result;
+// Decodes whole blocks of 32 base64 digits from `in` to `out` and returns how many digits were decoded.
+static size_t simd_base64_decode(const unsigned char* in, size_t len, char c62, char c63, char* out) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_base64_decode(in, len, c62, c63, out);
+#endif
+    (void) in; (void) len; (void) c62; (void) c63; (void) out;
+    return 0;
 }
 
-char* tf_invert_case(char* input) {
-    assert(input != NULL);
+// Hex encodes whole blocks of 16 bytes from `in` to `out` and returns how many bytes were encoded.
+static size_t simd_hex_encode(const unsigned char* in, size_t len, bool upper, char* out) {
+#ifdef EGG_SIMD_X86
+    return sse2_hex_encode(in, len, upper, out);
+#else
+    (void) in; (void) len; (void) upper; (void) out;
+    return 0;
+#endif
+}
 
-    char* result = duplicate_string(input);
-    for (size_t i = 0; result[i]; ++i) {
-        if (isUpper(result[i])) {
-            result[i] = toLower(result[i]);
-        } else if (isLower(result[i])) {
-            result[i] = toUpper(result[i]);
-        }
-    }
-    return result;
+// Decodes whole blocks of 32 hex digits from `in` to `out` and returns how many digits were decoded.
+static size_t simd_hex_decode(const unsigned char* in, size_t len, char* out) {
+#ifdef EGG_SIMD_X86
+    return sse2_hex_decode(in, len, out);
+#else
+    (void) in; (void) len; (void) out;
+    return 0;
+#endif
 }
 
-char* file_contents(const char* filename) {
-    FILE* file = fopen_or_die(filename, "rb");
-    
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    char* contents = malloc_or_die(size + 1);
-    size_t read_size = fread(contents, 1, size, file);
-    assert_msgf(read_size == size, "Could not read file completely! Requested %zu bytes, read %zu bytes", size, read_size);
-    contents[size] = '\0';
-    fclose_or_die(&file);
-    return contents;
+// Copies the bytes of whole blocks of `in` other than `c` to `out` at *k and returns how many bytes were read.
+static size_t simd_remove_byte(const char* in, size_t n, char c, char* out, size_t* k) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_remove_byte(in, n, c, out, k);
+    return sse2_remove_byte(in, n, c, out, k);
+#else
+    (void) in; (void) n; (void) c; (void) out; (void) k;
+    return 0;
+#endif
 }
 
-char* file_contents_without_lines_with_hash(const char* filename) {
-    char* contents = file_contents(filename);
-    
-    String str = {0};
-    for (size_t i = 0; contents[i]; ++i) {
-        if (contents[i] == '#') {
-            // skip to end of line
-            while (contents[i] && contents[i] != '\n') i++;
-        } else {
-            String_appendChar(&str, contents[i]);
-        }
-    }
-    String_appendTerminator(&str);
-    free_or_die(&contents);
-    return str.items; // return the string builder's items as the result
+// Looks for `needle` (at least two bytes) in `s`. Sets `found` and returns the position of the
+// first match, or returns how far no match can start.
+static size_t simd_find(const char* s, size_t n, const char* needle, size_t m, bool* found) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_AVX2)) return avx2_find(s, n, needle, m, found);
+    return sse2_find(s, n, needle, m, found);
+#else
+    (void) s; (void) n; (void) needle; (void) m; (void) found;
+    return 0;
+#endif
 }
 
-void join_path(char *out, size_t out_size, const char *a, const char *b) {
-#ifdef _WIN32
-    snprintf(out, out_size, "%s\\%s", a, b);
+static size_t simd_skip_space(const char* s, size_t n) {
+#ifdef EGG_SIMD_X86
+    return sse2_skip_space(s, n);
 #else
-    snprintf(out, out_size, "%s/%s", a, b);
+    (void) s; (void) n;
+    return 0;
 #endif
 }
 
-char *find_file_path_fragment(const char *base_path, const char *needle, const char *relative_path, bool *found) {
-#ifdef _WIN32
-    WIN32_FIND_DATAA ffd;
-    char search_path[MAX_PATH];
-    snprintf(search_path, sizeof(search_path), "%s\\*", base_path);
-    HANDLE hFind = FindFirstFileA(search_path, &ffd);
-    assert_msg(hFind != INVALID_HANDLE_VALUE, "Could not open directory");
+static size_t simd_skip_space_back(const char* s, size_t n) {
+#ifdef EGG_SIMD_X86
+    return sse2_skip_space_back(s, n);
+#else
+    (void) s; (void) n;
+    return 0;
+#endif
+}
 
-    do {
-        if (strcmp(ffd.cFileName, ".") == 0 || strcmp(ffd.cFileName, "..") == 0)
-            continue;
+// The tf_* functions taking a single String transform it in place. The ones that change
+// the size of the string in a way that cannot be done in place write their result to `out`,
+// which is emptied first but keeps its capacity (see swap_spare).
+
+void tf_upper(String* str) {
+    for (size_t i = simd_flip_case(str->items, str->count, 0, 'a', 'z'); i < str->count; ++i) {
+        str->items[i] = toUpper(str->items[i]);
+    }
+}
+void tf_lower(String* str) {
+    for (size_t i = simd_flip_case(str->items, str->count, 0, 'A', 'Z'); i < str->count; ++i) {
+        str->items[i] = toLower(str->items[i]);
+    }
+}
+void tf_reverse(String* str) {
+    size_t len = str->count;
+    for (size_t i = 0; i < len / 2; ++i) {
+        char temp = str->items[i];
+        str->items[i] = str->items[len - i - 1];
+        str->items[len - i - 1] = temp;
+    }
+}
+void tf_capitalize(String* str) {
+    bool capitalize_next = true;
+    for (size_t i = 0; i < str->count; ++i) {
+        if (isSpace(str->items[i])) {
+            capitalize_next = true;
+        } else if (capitalize_next) {
+            str->items[i] = toUpper(str->items[i]);
+            capitalize_next = false;
+        }
+    }
+}
+void tf_decapitalize(String* str) {
+    bool decapitalize_next = true;
+    for (size_t i = 0; i < str->count; ++i) {
+        if (isSpace(str->items[i])) {
+            decapitalize_next = true;
+        } else if (decapitalize_next) {
+            str->items[i] = toLower(str->items[i]);
+            decapitalize_next = false;
+        }
+    }
+}
+void tf_duplicate(String* str) {
+    String_reserve(str, str->count * 2);
+    if (str->count > 0) {
+        memcpy(str->items + str->count, str->items, str->count);
+    }
+    str->count *= 2;
+}
+void tf_strip(String* str) {
+    size_t k = 0;
+    for (size_t i = simd_strip(str->items, str->count, &k); i < str->count; ++i) {
+        if (!isSpace(str->items[i])) {
+            str->items[k++] = str->items[i];
+        }
+    }
+    str->count = k;
+}
+void tf_trim(String* str) {
+    size_t start = simd_skip_space(str->items, str->count);
+    while (start < str->count && isSpace(str->items[start])) {
+        ++start;
+    }
+    size_t end = str->count - simd_skip_space_back(str->items + start, str->count - start);
+    while (end > start && isSpace(str->items[end - 1])) {
+        --end;
+    }
+    if (start > 0) {
+        memmove(str->items, str->items + start, end - start);
+    }
+    str->count = end - start;
+}
+void tf_join(String* str) {
+    for (size_t i = simd_join(str->items, str->count); i < str->count; ++i) {
+        if (isSpace(str->items[i])) {
+            str->items[i] = '_';
+        }
+    }
+}
+void tf_byte_map(String* str, const unsigned char* table) {
+    unsigned char* s = (unsigned char*) str->items;
+    for (size_t i = simd_byte_map(s, str->count, table); i < str->count; ++i) {
+        s[i] = table[s[i]];
+    }
+}
+void tf_escape(const String* input, String* out) {
+    out->count = 0;
+    String_reserve(out, input->count * 2);
+    for (size_t i = 0; i < input->count; ++i) {
+        char escaped = escaped_chars[(unsigned char) input->items[i]];
+        if (escaped) {
+            out->items[out->count++] = '\\';
+            out->items[out->count++] = escaped;
+        } else {
+            out->items[out->count++] = input->items[i];
+        }
+    }
+}
+// Unescapes the escape sequences starting before `stop`, appending the result to `out`.
+// Returns how many bytes of `input` were consumed.
+size_t unescape_chars(const char* input, size_t len, size_t stop, String* out) {
+    size_t i = 0;
+    while (i < stop) {
+        if (input[i] != '\\' || i + 1 == len) {
+            String_appendChar(out, input[i]);
+            i++;
+        } else if (input[i + 1] != 'x') {
+            unsigned char c = input[i + 1];
+            String_appendChar(out, c < sizeof(unescaped_chars) ? unescaped_chars[c] : (char) c);
+            i += 2;
+        } else {
+            char hex[3] = {0};
+            size_t digits = 0;
+            for (i += 2; digits < 2 && i < len; ++digits) {
+                hex[digits] = input[i++];
+            }
+            String_appendChar(out, (char) strtol(hex, NULL, 16));
+        }
+    }
+    return i;
+}
+void tf_unescape(const String* input, String* out) {
+    out->count = 0;
+    String_reserve(out, input->count);
+    unescape_chars(input->items, input->count, input->count, out);
+}
+void tf_drop(String* str) {
+    if (str->count > 0) {
+        str->count--;
+    }
+}
+
+// Base64 digits and the reverse mapping of every byte to its digit value, or one of the markers below.
+typedef struct Base64Alphabet {
+    const char* chars;
+    unsigned char values[256];
+} Base64Alphabet;
+
+#define BASE64_PAD 0xFD     // '='
+#define BASE64_SPACE 0xFE   // whitespace, skipped when decoding
+#define BASE64_INVALID 0xFF
+
+static const Base64Alphabet base64_standard = {
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+    {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfd, 0xff, 0xff,
+        0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+        0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    }
+};
+
+// RFC 4648 section 5, safe to use in URLs and file names.
+static const Base64Alphabet base64_url = {
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_",
+    {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff,
+        0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xfd, 0xff, 0xff,
+        0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+        0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0x3f,
+        0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    }
+};
+
+// Appends the base64 encoding of `len` bytes of `input` to `out`, padded with '=' to a multiple of four if `pad` is set.
+void base64_encode(const char* input, size_t len, const Base64Alphabet* alphabet, bool pad, String* out) {
+    const unsigned char* in = (const unsigned char*) input;
+    const char* chars = alphabet->chars;
+    String_reserve(out, out->count + (len + 2) / 3 * 4);
+    char* o = out->items + out->count;
+
+    size_t i = simd_base64_encode(in, len, chars[62], chars[63], o);
+    o += i / 3 * 4;
+    for (; i + 3 <= len; i += 3) {
+        unsigned long v = (unsigned long) in[i] << 16 | (unsigned long) in[i + 1] << 8 | in[i + 2];
+        o[0] = chars[v >> 18];
+        o[1] = chars[(v >> 12) & 0x3F];
+        o[2] = chars[(v >> 6) & 0x3F];
+        o[3] = chars[v & 0x3F];
+        o += 4;
+    }
+    if (i < len) {
+        unsigned long v = (unsigned long) in[i] << 16 | (i + 1 < len ? (unsigned long) in[i + 1] << 8 : 0);
+        *o++ = chars[v >> 18];
+        *o++ = chars[(v >> 12) & 0x3F];
+        if (i + 1 < len) {
+            *o++ = chars[(v >> 6) & 0x3F];
+        } else if (pad) {
+            *o++ = '=';
+        }
+        if (pad) {
+            *o++ = '=';
+        }
+    }
+    out->count = o - out->items;
+}
+
+// Writes the `digits - 1` bytes of a final group of 2 or 3 base64 digits.
+static char* base64_decode_tail(unsigned long group, int digits, char* o) {
+    group <<= 6 * (4 - digits);
+    *o++ = (char) (group >> 16);
+    if (digits == 3) {
+        *o++ = (char) (group >> 8);
+    }
+    return o;
+}
+
+// Appends the bytes encoded by `len` base64 digits from `input` to `out`. Whitespace is skipped
+// and padding is optional, anything else that is not a digit is an error. `finished` is set once
+// a padded group was decoded, after which only whitespace may follow.
+// Returns how much of the input was used; unless `eof` is set an incomplete last group is left over.
+size_t base64_decode(const char* input, size_t len, const Base64Alphabet* alphabet, bool eof, bool* finished, String* out) {
+    const unsigned char* in = (const unsigned char*) input;
+    const unsigned char* values = alphabet->values;
+    String_reserve(out, out->count + len / 4 * 3 + 32); // the vector path stores 32 bytes at a time
+    char* o = out->items + out->count;
+
+    size_t i = 0;
+    size_t consumed = 0;
+    unsigned long group = 0;
+    int digits = 0;
+    int padding = 0;
+    while (i < len) {
+        if (digits == 0 && padding == 0 && !*finished) {
+            size_t n = simd_base64_decode(in + i, len - i, alphabet->chars[62], alphabet->chars[63], o);
+            i += n;
+            o += n / 4 * 3;
+            for (; i + 4 <= len; i += 4) {
+                unsigned long a = values[in[i]], b = values[in[i + 1]], c = values[in[i + 2]], d = values[in[i + 3]];
+                if ((a | b | c | d) >= 64) break;
+                unsigned long v = a << 18 | b << 12 | c << 6 | d;
+                o[0] = (char) (v >> 16);
+                o[1] = (char) (v >> 8);
+                o[2] = (char) v;
+                o += 3;
+            }
+            consumed = i;
+            if (i == len) break;
+        }
+
+        unsigned char c = in[i];
+        unsigned char v = values[c];
+        if (v < 64) {
+            assert_msg(!*finished && padding == 0, "Invalid base64 input: data after padding");
+            group = group << 6 | v;
+            if (++digits == 4) {
+                o[0] = (char) (group >> 16);
+                o[1] = (char) (group >> 8);
+                o[2] = (char) group;
+                o += 3;
+                group = 0;
+                digits = 0;
+                consumed = i + 1;
+            }
+        } else if (v == BASE64_PAD) {
+            assert_msg(!*finished && digits >= 2 && digits + padding < 4, "Invalid base64 input: misplaced '='");
+            if (digits + ++padding == 4) {
+                o = base64_decode_tail(group, digits, o);
+                group = 0;
+                digits = 0;
+                padding = 0;
+                *finished = true;
+                consumed = i + 1;
+            }
+        } else {
+            assert_msgf(v == BASE64_SPACE, "Invalid base64 input: unexpected character 0x%02x", c);
+            if (digits == 0 && padding == 0) {
+                consumed = i + 1;
+            }
+        }
+        ++i;
+    }
+
+    if (eof) {
+        assert_msg(digits != 1 && padding == 0, "Invalid base64 input: truncated");
+        if (digits > 0) {
+            o = base64_decode_tail(group, digits, o);
+        }
+        consumed = len;
+    }
+    out->count = o - out->items;
+    return consumed;
+}
+
+void tf_base64_encode(const String* input, String* out) {
+    out->count = 0;
+    base64_encode(input->items, input->count, &base64_standard, true, out);
+}
+
+void tf_base64_encode_unpadded(const String* input, String* out) {
+    out->count = 0;
+    base64_encode(input->items, input->count, &base64_standard, false, out);
+}
+
+void tf_base64url_encode(const String* input, String* out) {
+    out->count = 0;
+    base64_encode(input->items, input->count, &base64_url, false, out);
+}
+
+void tf_base64_decode(const String* input, String* out) {
+    bool finished = false;
+    out->count = 0;
+    base64_decode(input->items, input->count, &base64_standard, true, &finished, out);
+}
+
+void tf_base64url_decode(const String* input, String* out) {
+    bool finished = false;
+    out->count = 0;
+    base64_decode(input->items, input->count, &base64_url, true, &finished, out);
+}
+
+#define HEX_SPACE 0xFE   // whitespace, skipped when decoding
+#define HEX_INVALID 0xFF
+
+// Value of every hex digit, either case.
+static const unsigned char hex_values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+// Appends the hex encoding of `len` bytes of `input` to `out`, with uppercase letters if `upper` is set.
+void hex_encode(const char* input, size_t len, bool upper, String* out) {
+    const unsigned char* in = (const unsigned char*) input;
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    String_reserve(out, out->count + len * 2);
+    char* o = out->items + out->count;
+
+    size_t i = simd_hex_encode(in, len, upper, o);
+    o += i * 2;
+    for (; i < len; ++i) {
+        *o++ = digits[in[i] >> 4];
+        *o++ = digits[in[i] & 0x0F];
+    }
+    out->count = o - out->items;
+}
+
+// Appends the bytes encoded by the hex digits in `input` to `out`. Whitespace between the pairs
+// of digits is skipped, anything else is an error. Returns how much of the input was used;
+// unless `eof` is set a trailing single digit is left over.
+size_t hex_decode(const char* input, size_t len, bool eof, String* out) {
+    const unsigned char* in = (const unsigned char*) input;
+    String_reserve(out, out->count + len / 2);
+    char* o = out->items + out->count;
+
+    size_t i = 0;
+    while (i < len) {
+        size_t n = simd_hex_decode(in + i, len - i, o);
+        i += n;
+        o += n / 2;
+        for (; i + 2 <= len; i += 2) {
+            unsigned char a = hex_values[in[i]], b = hex_values[in[i + 1]];
+            if ((a | b) >= 16) break;
+            *o++ = (char) (a << 4 | b);
+        }
+        if (i == len) break;
+
+        unsigned char high = hex_values[in[i]];
+        if (high == HEX_SPACE) {
+            ++i;
+            continue;
+        }
+        assert_msgf(high < 16, "Invalid hex input: unexpected character 0x%02x", in[i]);
+        if (i + 1 == len) {
+            assert_msg(!eof, "Invalid hex input: odd number of digits");
+            break;
+        }
+        unsigned char low = hex_values[in[i + 1]];
+        assert_msgf(low < 16, "Invalid hex input: unexpected character 0x%02x", in[i + 1]);
+        *o++ = (char) (high << 4 | low);
+        i += 2;
+    }
+    out->count = o - out->items;
+    return i;
+}
+
+void tf_hex_encode(const String* input, String* out) {
+    out->count = 0;
+    hex_encode(input->items, input->count, false, out);
+}
+
+void tf_hex_encode_upper(const String* input, String* out) {
+    out->count = 0;
+    hex_encode(input->items, input->count, true, out);
+}
+
+void tf_hex_decode(const String* input, String* out) {
+    out->count = 0;
+    hex_decode(input->items, input->count, true, out);
+}
+
+void tf_xor_cipher(String* input, String* out) {
+    for (size_t i = 0; i < input->count; ++i) {
+        input->items[i] ^= 0xFF; // simple XOR obfuscation
+    }
+    tf_hex_encode(input, out);
+}
+
+// Slicing-by-8 tables for the reflected CRC-32 (zlib, PNG) and CRC-32C (iSCSI, ext4) polynomials.
+// crc*_tables[0] is the classic byte-at-a-time table, table k advances a byte by k more zero bytes.
+#define CRC32_POLY 0xedb88320u
+#define CRC32C_POLY 0x82f63b78u
+
+static unsigned int crc32_tables[8][256];
+static unsigned int crc32c_tables[8][256];
+
+static void crc_make_tables(unsigned int tables[8][256], unsigned int poly) {
+    for (unsigned int n = 0; n < 256; ++n) {
+        unsigned int c = n;
+        for (int k = 0; k < 8; ++k) {
+            c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+        }
+        tables[0][n] = c;
+    }
+    for (unsigned int n = 0; n < 256; ++n) {
+        for (int k = 1; k < 8; ++k) {
+            tables[k][n] = tables[0][tables[k - 1][n] & 0xff] ^ (tables[k - 1][n] >> 8);
+        }
+    }
+}
+
+// Builds the lookup tables. Called while compiling a checksum operator, so that
+// it has happened before anything runs.
+void crc_init(void) {
+    static bool initialized = false;
+    if (!initialized) {
+        crc_make_tables(crc32_tables, CRC32_POLY);
+        crc_make_tables(crc32c_tables, CRC32C_POLY);
+        initialized = true;
+    }
+}
+
+// Continues the inverted register `crc` over `len` bytes, eight at a time.
+static unsigned int crc_slice8(unsigned int tables[8][256], unsigned int crc, const unsigned char* buffer, size_t len) {
+    for (; len >= 8; len -= 8, buffer += 8) {
+        crc ^= (unsigned int) buffer[0] | (unsigned int) buffer[1] << 8 | (unsigned int) buffer[2] << 16 | (unsigned int) buffer[3] << 24;
+        crc = tables[7][crc & 0xff] ^ tables[6][(crc >> 8) & 0xff] ^ tables[5][(crc >> 16) & 0xff] ^ tables[4][crc >> 24]
+            ^ tables[3][buffer[4]] ^ tables[2][buffer[5]] ^ tables[1][buffer[6]] ^ tables[0][buffer[7]];
+    }
+    for (; len > 0; --len) {
+        crc = tables[0][(crc ^ *buffer++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef EGG_SIMD_X86
+// Folds 64 bytes at a time with carry-less multiplication, then reduces to 32 bits
+// (Gopal et al., "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ").
+// `len` must be a multiple of 16 and at least 64; `crc` is the inverted register.
+__attribute__((target("pclmul,sse4.1")))
+static unsigned int pclmul_crc32(unsigned int crc, const unsigned char* buffer, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) buffer), _mm_cvtsi32_si128((int) crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i*) (buffer + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*) (buffer + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*) (buffer + 48));
+    buffer += 64;
+    len -= 64;
+
+    for (; len >= 64; buffer += 64, len -= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), x5);
+        x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), x6);
+        x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), x7);
+        x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), x8);
+        x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*) buffer));
+        x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*) (buffer + 16)));
+        x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*) (buffer + 32)));
+        x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*) (buffer + 48)));
+    }
+
+    // Fold the four lanes into one, then any remaining blocks of 16.
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x2);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x3);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)), x4);
+    for (; len >= 16; buffer += 16, len -= 16) {
+        x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), _mm_clmulepi64_si128(x1, k3k4, 0x00)),
+                           _mm_loadu_si128((const __m128i*) buffer));
+    }
+
+    // 128 -> 64 bits.
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), _mm_srli_si128(x1, 4));
+
+    // Barrett reduction to 32 bits.
+    __m128i x2b = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+    x2b = _mm_clmulepi64_si128(_mm_and_si128(x2b, mask32), poly, 0x00);
+    return (unsigned int) _mm_extract_epi32(_mm_xor_si128(x1, x2b), 1);
+}
+
+// CRC-32C is what the SSE4.2 crc32 instruction computes.
+__attribute__((target("sse4.2")))
+static unsigned int sse42_crc32c(unsigned int crc, const unsigned char* buffer, size_t len) {
+    unsigned long long c = crc;
+    for (; len >= 8; len -= 8, buffer += 8) {
+        unsigned long long word;
+        memcpy(&word, buffer, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (unsigned int) c;
+    for (; len > 0; --len) {
+        crc = _mm_crc32_u8(crc, *buffer++);
+    }
+    return crc;
+}
+#endif
+
+// Continues the checksum `crc` (0 for a new one) over `len` more bytes.
+unsigned int crc32(unsigned int crc, const unsigned char* buffer, size_t len) {
+    crc = ~crc;
+#ifdef EGG_SIMD_X86
+    if (len >= 64 && cpu_has(CPU_PCLMUL)) {
+        crc = pclmul_crc32(crc, buffer, len & ~(size_t) 15);
+        buffer += len & ~(size_t) 15;
+        len &= 15;
+    }
+#endif
+    return ~crc_slice8(crc32_tables, crc, buffer, len);
+}
+
+// Same as crc32, with the Castagnoli polynomial.
+unsigned int crc32c(unsigned int crc, const unsigned char* buffer, size_t len) {
+#ifdef EGG_SIMD_X86
+    if (cpu_has(CPU_SSE42)) return ~sse42_crc32c(~crc, buffer, len);
+#endif
+    return ~crc_slice8(crc32c_tables, ~crc, buffer, len);
+}
+
+// Multiplies two polynomials modulo the reflected polynomial `poly`.
+static unsigned int crc_multiply(unsigned int a, unsigned int b, unsigned int poly) {
+    unsigned int product = 0;
+    for (unsigned int m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+    }
+    return product;
+}
+
+// Returns the checksum of A followed by B, given the checksums of A and B and the length of B.
+unsigned int crc_combine(unsigned int crc_a, unsigned int crc_b, size_t len_b, unsigned int poly) {
+    // Appending B multiplies A's remainder by x^(8 * len_b); x^0 is the top bit when reflected.
+    unsigned int shift = 1u << 31;
+    unsigned int square = 1u << 23; // x^8
+    for (; len_b > 0; len_b >>= 1) {
+        if (len_b & 1) {
+            shift = crc_multiply(shift, square, poly);
+        }
+        square = crc_multiply(square, square, poly);
+    }
+    return crc_multiply(shift, crc_a, poly) ^ crc_b;
+}
+
+typedef struct Context Context;
+
+// Calls `function` for every batch from 0 to batch_count - 1, on the thread pool if there is one.
+// See run_batches below.
+typedef void (*BatchFunction)(void* job, size_t batch, Context* ctx);
+void run_batches(BatchFunction function, void* job, size_t batch_count, Context* ctx);
+size_t thread_count(void);
+
+typedef unsigned int (*CrcFunction)(unsigned int crc, const unsigned char* buffer, size_t len);
+
+#define CRC_PARALLEL_MIN_SIZE (16 << 20)
+#define CRC_PARALLEL_MAX_PARTS 64
+
+typedef struct CrcJob {
+    CrcFunction function;
+    const unsigned char* buffer;
+    size_t len;
+    size_t parts;
+    unsigned int crc[CRC_PARALLEL_MAX_PARTS];
+} CrcJob;
+
+static size_t crc_part_size(const CrcJob* job) {
+    return job->len / job->parts;
+}
+
+static void crc_part(void* arg, size_t part, Context* ctx) {
+    (void) ctx;
+    CrcJob* job = arg;
+    size_t size = crc_part_size(job);
+    size_t len = part + 1 < job->parts ? size : job->len - part * size;
+    job->crc[part] = job->function(0, job->buffer + part * size, len);
+}
+
+// Checksums large buffers in one piece per thread and combines the results.
+unsigned int crc_parallel(CrcFunction function, unsigned int poly, const unsigned char* buffer, size_t len) {
+    CrcJob job = { .function = function, .buffer = buffer, .len = len, .parts = thread_count() };
+    if (job.parts > CRC_PARALLEL_MAX_PARTS) job.parts = CRC_PARALLEL_MAX_PARTS;
+    if (job.parts > len / (CRC_PARALLEL_MIN_SIZE / 2)) job.parts = len / (CRC_PARALLEL_MIN_SIZE / 2);
+    if (len < CRC_PARALLEL_MIN_SIZE || job.parts < 2) {
+        return function(0, buffer, len);
+    }
+    run_batches(crc_part, &job, job.parts, NULL);
+    unsigned int crc = job.crc[0];
+    for (size_t k = 1; k < job.parts; ++k) {
+        size_t part_len = k + 1 < job.parts ? crc_part_size(&job) : len - k * crc_part_size(&job);
+        crc = crc_combine(crc, job.crc[k], part_len, poly);
+    }
+    return crc;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+// Incremental state of the 64-bit xxHash (XXH64) with seed 0.
+typedef struct Xxh64 {
+    uint64_t acc[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    size_t buffered;
+} Xxh64;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read_le64(const unsigned char* p) {
+    uint64_t v = 0;
+    for (int k = 7; k >= 0; --k) v = v << 8 | p[k];
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * XXH_PRIME64_2, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t hash, uint64_t acc) {
+    return (hash ^ xxh64_round(0, acc)) * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64_init(Xxh64* state) {
+    memset(state, 0, sizeof(*state));
+    state->acc[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->acc[1] = XXH_PRIME64_2;
+    state->acc[2] = 0;
+    state->acc[3] = 0 - XXH_PRIME64_1;
+}
+
+static void xxh64_stripe(Xxh64* state, const unsigned char* p) {
+    for (int k = 0; k < 4; ++k) {
+        state->acc[k] = xxh64_round(state->acc[k], read_le64(p + 8 * k));
+    }
+}
+
+void xxh64_update(Xxh64* state, const unsigned char* input, size_t len) {
+    state->total += len;
+    if (state->buffered + len < 32) {
+        if (len > 0) memcpy(state->buffer + state->buffered, input, len);
+        state->buffered += len;
+        return;
+    }
+    if (state->buffered > 0) {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, input, fill);
+        xxh64_stripe(state, state->buffer);
+        input += fill;
+        len -= fill;
+        state->buffered = 0;
+    }
+    for (; len >= 32; input += 32, len -= 32) {
+        xxh64_stripe(state, input);
+    }
+    if (len > 0) memcpy(state->buffer, input, len);
+    state->buffered = len;
+}
+
+uint64_t xxh64_digest(const Xxh64* state) {
+    uint64_t hash;
+    if (state->total >= 32) {
+        hash = rotl64(state->acc[0], 1) + rotl64(state->acc[1], 7) + rotl64(state->acc[2], 12) + rotl64(state->acc[3], 18);
+        for (int k = 0; k < 4; ++k) {
+            hash = xxh64_merge(hash, state->acc[k]);
+        }
+    } else {
+        hash = XXH_PRIME64_5;
+    }
+    hash += state->total;
+
+    const unsigned char* p = state->buffer;
+    size_t len = state->buffered;
+    for (; len >= 8; p += 8, len -= 8) {
+        hash = rotl64(hash ^ xxh64_round(0, read_le64(p)), 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (len >= 4) {
+        uint64_t word = (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24;
+        hash = rotl64(hash ^ word * XXH_PRIME64_1, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++p, --len) {
+        hash = rotl64(hash ^ *p * XXH_PRIME64_5, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Writes a checksum as `digits` lowercase hex digits to `out`.
+void checksum_to_hex(uint64_t checksum, int digits, String* out) {
+    out->count = 0;
+    String_reserve(out, (size_t) digits + 1);
+    snprintf(out->items, digits + 1, "%0*llx", digits, (unsigned long long) checksum);
+    out->count = digits;
+}
+
+void tf_crc32(const String* input, String* out) {
+    unsigned int crc = crc_parallel(crc32, CRC32_POLY, (const unsigned char*) input->items, input->count);
+    checksum_to_hex(crc, 8, out);
+}
+
+void tf_crc32c(const String* input, String* out) {
+    unsigned int crc = crc_parallel(crc32c, CRC32C_POLY, (const unsigned char*) input->items, input->count);
+    checksum_to_hex(crc, 8, out);
+}
+
+void tf_xxh64(const String* input, String* out) {
+    Xxh64 state;
+    xxh64_init(&state);
+    xxh64_update(&state, (const unsigned char*) input->items, input->count);
+    checksum_to_hex(xxh64_digest(&state), 16, out);
+}
+
+void tf_invert_case(String* str) {
+    for (size_t i = simd_flip_case(str->items, str->count, 0x20, 'a', 'z'); i < str->count; ++i) {
+        if (isUpper(str->items[i])) {
+            str->items[i] = toLower(str->items[i]);
+        } else if (isLower(str->items[i])) {
+            str->items[i] = toUpper(str->items[i]);
+        }
+    }
+}
+
+char* file_contents(const char* filename) {
+    FILE* file = fopen_or_die(filename, "rb");
+    
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    char* contents = malloc_or_die(size + 1);
+    size_t read_size = fread(contents, 1, size, file);
+    assert_msgf(read_size == size, "Could not read file completely! Requested %zu bytes, read %zu bytes", size, read_size);
+    contents[size] = '\0';
+    fclose_or_die(&file);
+    return contents;
+}
+
+char* file_contents_without_lines_with_hash(const char* filename) {
+    char* contents = file_contents(filename);
+    
+    String str = {0};
+    String_reserve(&str, strlen(contents) + 1);
+    for (const char* line = contents; *line;) {
+        // copy up to the next '#', then skip to the end of the line
+        size_t len = strcspn(line, "#");
+        String_appendMany(&str, line, len);
+        line += len;
+        if (*line == '#') {
+            line += strcspn(line, "\n");
+        }
+    }
+    String_appendTerminator(&str);
+    free_or_die(&contents);
+    return str.items; // return the string builder's items as the result
+}
+
+void join_path(char *out, size_t out_size, const char *a, const char *b) {
+#ifdef _WIN32
+    snprintf(out, out_size, "%s\\%s", a, b);
+#else
+    snprintf(out, out_size, "%s/%s", a, b);
+#endif
+}
+
+// 64-bit FNV-1a, for telling files and paths apart.
+uint64_t fnv1a(const char* data, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t k = 0; k < len; ++k) {
+        hash = (hash ^ (unsigned char) data[k]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+typedef struct {
+    char** items;
+    size_t count;
+    size_t capacity;
+} PathList;
+
+// A directory walked while indexing, with its modification time, which changes whenever
+// an entry is added to, removed from or renamed in the directory.
+typedef struct {
+    char* path;
+    long long mtime;
+} DirStamp;
+
+typedef struct {
+    DirStamp* items;
+    size_t count;
+    size_t capacity;
+} DirStampList;
+
+// The files below a basket search directory whose path contains ".basket", relative to it and in
+// the order of the directory walk, so the first one matching a name is the one a walk would find.
+typedef struct {
+    char* root;
+    PathList files;
+    DirStampList dirs;
+    bool loaded;
+} BasketIndex;
+
+void index_directory(BasketIndex* index, const char *base_path, const char *relative_path) {
+#ifdef _WIN32
+    WIN32_FIND_DATAA ffd;
+    char search_path[MAX_PATH];
+    snprintf(search_path, sizeof(search_path), "%s\\*", base_path);
+    HANDLE hFind = FindFirstFileA(search_path, &ffd);
+    assert_msg(hFind != INVALID_HANDLE_VALUE, "Could not open directory");
+
+    do {
+        if (strcmp(ffd.cFileName, ".") == 0 || strcmp(ffd.cFileName, "..") == 0)
+            continue;
 
         char full_path[MAX_PATH];
         join_path(full_path, sizeof(full_path), base_path, ffd.cFileName);
 
-        char new_rel_path[4096];
-        if (relative_path[0])
-            snprintf(new_rel_path, sizeof(new_rel_path), "%s/%s", relative_path, ffd.cFileName);
-        else
-            snprintf(new_rel_path, sizeof(new_rel_path), "%s", ffd.cFileName);
+        char new_rel_path[4096];
+        if (relative_path[0])
+            snprintf(new_rel_path, sizeof(new_rel_path), "%s/%s", relative_path, ffd.cFileName);
+        else
+            snprintf(new_rel_path, sizeof(new_rel_path), "%s", ffd.cFileName);
+
+        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            index_directory(index, full_path, new_rel_path);
+        } else if (strstr(new_rel_path, ".basket")) {
+            List_append(&index->files, duplicate_string(new_rel_path));
+        }
+    } while (FindNextFileA(hFind, &ffd));
+
+    FindClose(hFind);
+#else
+    DIR *dir = opendir(base_path);
+    assert_msg(dir != NULL, "Could not open directory");
+
+    struct stat st;
+    if (stat(base_path, &st) == 0) {
+        DirStamp stamp = { .path = duplicate_string(base_path), .mtime = st.st_mtime };
+        List_append(&index->dirs, stamp);
+    }
+
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != NULL) {
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+
+        char full_path[4096];
+        join_path(full_path, sizeof(full_path), base_path, dp->d_name);
+
+        char new_rel_path[4096];
+        if (relative_path[0])
+            snprintf(new_rel_path, sizeof(new_rel_path), "%s/%s", relative_path, dp->d_name);
+        else
+            snprintf(new_rel_path, sizeof(new_rel_path), "%s", dp->d_name);
+
+        if (stat(full_path, &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            index_directory(index, full_path, new_rel_path);
+        } else if (S_ISREG(st.st_mode) && strstr(new_rel_path, ".basket") && !strchr(new_rel_path, '\n')) {
+            List_append(&index->files, duplicate_string(new_rel_path));
+        }
+    }
+
+    closedir(dir);
+#endif
+}
+
+void free_basket_index(BasketIndex* index) {
+    for (size_t k = 0; k < index->files.count; ++k) {
+        free_or_die(&index->files.items[k]);
+    }
+    for (size_t k = 0; k < index->dirs.count; ++k) {
+        free_or_die(&index->dirs.items[k].path);
+    }
+    if (index->files.items) free_or_die(&index->files.items);
+    if (index->dirs.items) free_or_die(&index->dirs.items);
+    index->files = (PathList) {0};
+    index->dirs = (DirStampList) {0};
+    index->loaded = false;
+}
+
+#ifndef _WIN32
+#define BASKET_INDEX_HEADER "egg basket index 1"
+
+// The file that keeps the index of `root` between runs: $XDG_CACHE_HOME/egg/<hash>.index, or
+// ~/.cache/egg/<hash>.index, where the hash is of the absolute path of `root`.
+// Returns false if there is no place for it.
+bool basket_index_file(const char* root, String* file, String* absolute_root) {
+    char* absolute = realpath(root, NULL);
+    if (!absolute) return false;
+
+    const char* cache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (cache && *cache) {
+        String_appendCStr(file, cache);
+    } else if (home) {
+        String_appendCStr(file, home);
+        String_appendCStr(file, "/.cache");
+    } else {
+        free(absolute);
+        return false;
+    }
+    String_appendTerminator(file);
+    mkdir(file->items, 0755);
+    file->count--;
+    String_appendCStr(file, "/egg");
+    String_appendTerminator(file);
+    mkdir(file->items, 0755);
+    file->count--;
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.index", (unsigned long long) fnv1a(absolute, strlen(absolute)));
+    String_appendCStr(file, name);
+    String_appendTerminator(file);
+    String_appendCStr(absolute_root, absolute);
+    String_appendTerminator(absolute_root);
+    free(absolute);
+    return true;
+}
+
+// Loads a saved index, if there is one for the same directory and none of its directories changed since.
+//
+// Format: a header line and the absolute path of the root, then one line per walked directory
+// ("d <mtime> <path>") and per file ("f <relative path>").
+bool load_basket_index(BasketIndex* index, const char* file, const char* absolute_root) {
+    struct stat st;
+    if (stat(file, &st) != 0) return false;
+
+    char* contents = file_contents(file);
+    bool valid = true;
+    char* line = contents;
+    for (size_t n = 0; valid && *line; ++n) {
+        char* end = strchr(line, '\n');
+        if (!end) {
+            valid = false;
+            break;
+        }
+        *end = '\0';
+        if (n == 0) {
+            valid = strcmp(line, BASKET_INDEX_HEADER) == 0;
+        } else if (n == 1) {
+            valid = strcmp(line, absolute_root) == 0;
+        } else if (line[0] == 'd' && line[1] == ' ') {
+            char* path;
+            long long mtime = strtoll(line + 2, &path, 10);
+            struct stat st;
+            valid = *path == ' ' && stat(path + 1, &st) == 0 && st.st_mtime == mtime;
+            if (valid) {
+                DirStamp stamp = { .path = duplicate_string(path + 1), .mtime = mtime };
+                List_append(&index->dirs, stamp);
+            }
+        } else if (line[0] == 'f' && line[1] == ' ') {
+            List_append(&index->files, duplicate_string(line + 2));
+        } else {
+            valid = false;
+        }
+        line = end + 1;
+    }
+    free_or_die(&contents);
+    if (!valid) {
+        free_basket_index(index);
+    }
+    return valid;
+}
+
+void save_basket_index(const BasketIndex* index, const char* file, const char* absolute_root) {
+    // A directory changed within the last second could change again without a new modification
+    // time, so such an index could not be trusted later on.
+    long long now = (long long) time(NULL);
+    for (size_t k = 0; k < index->dirs.count; ++k) {
+        if (index->dirs.items[k].mtime >= now - 1) return;
+    }
+
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s.%ld", file, (long) getpid());
+    FILE* out = fopen(temp, "wb");
+    if (!out) return; // not saving the index is no reason to fail
+    fprintf(out, "%s\n%s\n", BASKET_INDEX_HEADER, absolute_root);
+    for (size_t k = 0; k < index->dirs.count; ++k) {
+        fprintf(out, "d %lld %s\n", index->dirs.items[k].mtime, index->dirs.items[k].path);
+    }
+    for (size_t k = 0; k < index->files.count; ++k) {
+        fprintf(out, "f %s\n", index->files.items[k]);
+    }
+    bool written = fclose(out) == 0;
+    if (!written || rename(temp, file) != 0) {
+        remove(temp);
+    }
+}
+#endif
+
+// Indexes `root` on first use, from the saved index if it is still up to date.
+void load_or_build_basket_index(BasketIndex* index) {
+    if (index->loaded) return;
+#ifndef _WIN32
+    String file = {0};
+    String absolute_root = {0};
+    bool cached = basket_index_file(index->root, &file, &absolute_root);
+    if (!cached || !load_basket_index(index, file.items, absolute_root.items)) {
+        index_directory(index, index->root, "");
+        if (cached) {
+            save_basket_index(index, file.items, absolute_root.items);
+        }
+    }
+    free_string(&file);
+    free_string(&absolute_root);
+#else
+    index_directory(index, index->root, "");
+#endif
+    index->loaded = true;
+}
+
+// Basket search directories, in the order they are searched: ~/.egg, then the current directory.
+// Each is indexed once per run.
+BasketIndex basket_indexes[2];
+
+// Finds the first indexed file whose path contains `needle`, searching the directories in order.
+char *find_in_basket_indexes(const char *needle) {
+    for (size_t i = 0; i < sizeof(basket_indexes) / sizeof(basket_indexes[0]); ++i) {
+        BasketIndex* index = &basket_indexes[i];
+        load_or_build_basket_index(index);
+        for (size_t k = 0; k < index->files.count; ++k) {
+            if (strstr(index->files.items[k], needle)) {
+                char full_path[4096];
+                join_path(full_path, sizeof(full_path), index->root, index->files.items[k]);
+                return duplicate_string(full_path);
+            }
+        }
+    }
+    return NULL; // Not found in any directory
+}
+
+void free_basket_indexes(void) {
+    for (size_t i = 0; i < sizeof(basket_indexes) / sizeof(basket_indexes[0]); ++i) {
+        free_basket_index(&basket_indexes[i]);
+        if (basket_indexes[i].root) free_or_die(&basket_indexes[i].root);
+    }
+}
+
+String read_transformation(const char* transformation, size_t* i, Arena* arena) {
+    assert(i && transformation);
+    #define i (*i)
+    String trans = { .arena = arena };
+    while (isSpace(transformation[i])) i++;
+    switch (transformation[i]) {
+        case '{': {
+                int brace_depth = 0;
+                String_appendChar(&trans, '{');
+                i++;
+                while ((transformation[i] != '}' || brace_depth > 0) && transformation[i] != 0) {
+                    if (transformation[i] == '{') {
+                        brace_depth++;
+                    } else if (transformation[i] == '}') {
+                        brace_depth--;
+                    }
+                    String_appendChar(&trans, transformation[i]);
+                    i++;
+                }
+                if (transformation[i] == '}') {
+                    String_appendChar(&trans, '}');
+                } else {
+                    fprintf(stderr, "Error: Unmatched '{' in transformation.\n");
+                }
+            }
+            break;
+        case '[': {
+                int bracket_depth = 0;
+                String_appendChar(&trans, '[');
+                i++;
+                while ((transformation[i] != ']' || bracket_depth > 0) && transformation[i] != 0) {
+                    if (transformation[i] == '[') {
+                        bracket_depth++;
+                    } else if (transformation[i] == ']') {
+                        bracket_depth--;
+                    }
+                    String_appendChar(&trans, transformation[i]);
+                    i++;
+                }
+                if (transformation[i] == ']') {
+                    String_appendChar(&trans, ']');
+                } else {
+                    fprintf(stderr, "Error: Unmatched '[' in transformation.\n");
+                }
+            }
+            break;
+        case '(': {
+                int paren_depth = 0;
+                i++;
+                while ((transformation[i] != ')' || paren_depth > 0) && transformation[i] != 0) {
+                    if (transformation[i] == '(') {
+                        paren_depth++;
+                    } else if (transformation[i] == ')') {
+                        paren_depth--;
+                    }
+                    String_appendChar(&trans, transformation[i]);
+                    i++;
+                }
+                if (transformation[i] != ')') {
+                    fprintf(stderr, "Error: Unmatched '(' in transformation.\n");
+                }
+            }
+            break;
+        default: {
+                if (transformation[i] == '\\') {
+                    String_appendChar(&trans, transformation[i]);
+                    i++;
+                }
+                String_appendChar(&trans, transformation[i]);
+            }
+            break;
+    }
+    String_appendTerminator(&trans);
+    #undef i
+    return trans;
+}
+
+char read_char(const char* transformation, size_t* i) {
+    assert(i && transformation);
+    #define i (*i)
+    if (transformation[i] == '\\') {
+        i++;
+        switch (transformation[i]) {
+            case 'x': {
+                // hex
+                i++;
+                char hex[3] = {0};
+                hex[0] = transformation[i++];
+                hex[1] = transformation[i];
+                int value = (int)strtol(hex, NULL, 16);
+                return (char)value;
+            } break;
+            default:
+                return unescaped_chars[(int) transformation[i]];
+                break;
+        }
+    } else {
+        return transformation[i];
+    }
+    #undef i
+}
+
+// Reads a quoted string or a single character into `str`, which belongs to the caller
+// even if reading fails, so that it can be freed then.
+void read_string(const char* transformation, size_t* i, String* str) {
+    assert(i && transformation);
+    #define i (*i)
+    if (transformation[i] == '\'') {
+        i++;
+        while (transformation[i] != '\'' && transformation[i] != 0) {
+            String_appendChar(str, read_char(transformation, &i));
+            i++;
+        }
+    } else {
+        // just one char
+        String_appendChar(str, read_char(transformation, &i));
+    }
+    #undef i
+}
+
+int sort_match_replace(const void* va, const void* vb) {
+    const String* a = &((const ReplaceRule*) va)->from;
+    const String* b = &((const ReplaceRule*) vb)->from;
+    // Sort by length first, then lexicographically
+    if (a->count != b->count) {
+        return b->count < a->count ? -1 : 1;
+    }
+    return a->count ? -memcmp(a->items, b->items, a->count) : 0;
+}
+
+// Builds `rules->matcher` from the rules, which must already be sorted longest first.
+void build_matcher(ReplaceRules* rules) {
+    Matcher* m = &rules->matcher;
+    m->longest = 0;
+    m->empty_rule = -1;
+    memset(m->byte_rule, -1, sizeof(m->byte_rule));
+    memset(m->byte_class, 0, sizeof(m->byte_class));
+    m->class_count = 1;
+    for (size_t k = 0; k < rules->count; ++k) {
+        const String* from = &rules->items[k].from;
+        if (from->count == 0) {
+            if (m->empty_rule < 0) m->empty_rule = (int) k;
+            continue;
+        }
+        if (from->count > m->longest) m->longest = from->count;
+        if (from->count == 1 && m->byte_rule[(unsigned char) from->items[0]] < 0) {
+            m->byte_rule[(unsigned char) from->items[0]] = (int) k;
+        }
+        for (size_t j = 0; j < from->count; ++j) {
+            unsigned char c = from->items[j];
+            if (m->byte_class[c] == 0) m->byte_class[c] = (unsigned char) m->class_count++;
+        }
+    }
+    if (m->longest <= 1) {
+        return;
+    }
+
+    // The trie, with -1 for missing edges.
+    size_t classes = m->class_count;
+    size_t capacity = 16;
+    m->next = malloc_or_die(capacity * classes * sizeof(int));
+    m->rule = malloc_or_die(capacity * sizeof(int));
+    memset(m->next, -1, classes * sizeof(int));
+    m->rule[0] = -1;
+    m->state_count = 1;
+    for (size_t k = 0; k < rules->count; ++k) {
+        const String* from = &rules->items[k].from;
+        if (from->count == 0) continue;
+        int state = 0;
+        for (size_t j = 0; j < from->count; ++j) {
+            int* edge = &m->next[state * classes + m->byte_class[(unsigned char) from->items[j]]];
+            if (*edge < 0) {
+                if (m->state_count == capacity) {
+                    capacity *= 2;
+                    m->next = realloc_or_die(m->next, capacity * classes * sizeof(int));
+                    m->rule = realloc_or_die(m->rule, capacity * sizeof(int));
+                    edge = &m->next[state * classes + m->byte_class[(unsigned char) from->items[j]]];
+                }
+                memset(&m->next[m->state_count * classes], -1, classes * sizeof(int));
+                m->rule[m->state_count] = -1;
+                *edge = (int) m->state_count++;
+            }
+            state = *edge;
+        }
+        if (m->rule[state] < 0) {
+            m->rule[state] = (int) k; // equal 'from's: the first one wins, as before
+        }
+    }
+
+    // Breadth first, so the failure state of every state is complete before the state itself.
+    // Missing edges are replaced by the edge of the failure state.
+    int* fail = malloc_or_die(m->state_count * sizeof(int));
+    int* queue = malloc_or_die(m->state_count * sizeof(int));
+    m->output = malloc_or_die(m->state_count * sizeof(int));
+    size_t head = 0, tail = 0;
+    fail[0] = 0;
+    m->output[0] = -1;
+    for (size_t c = 0; c < classes; ++c) {
+        int child = m->next[c];
+        if (child < 0) {
+            m->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            m->output[child] = -1;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        for (size_t c = 0; c < classes; ++c) {
+            int* edge = &m->next[state * classes + c];
+            int follow = m->next[fail[state] * classes + c];
+            if (*edge < 0) {
+                *edge = follow;
+            } else {
+                fail[*edge] = follow;
+                m->output[*edge] = m->rule[follow] >= 0 ? follow : m->output[follow];
+                queue[tail++] = *edge;
+            }
+        }
+    }
+    free_or_die(&fail);
+    free_or_die(&queue);
+}
+
+void free_matcher(Matcher* m) {
+    if (m->next) free_or_die(&m->next);
+    if (m->rule) free_or_die(&m->rule);
+    if (m->output) free_or_die(&m->output);
+}
+
+char* find_basket(const char* name, Arena* scratch) {
+    String file_name = { .arena = scratch };
+    String_appendCStr(&file_name, name);
+    String_appendCStr(&file_name, ".basket");
+    String_appendTerminator(&file_name);
+
+    // look through all files in ~/.egg/**/**/ and the current directory
+    if (!basket_indexes[0].root) {
+        char* home = getenv("HOME");
+        assert_msg(home != NULL, "HOME environment variable is not set");
+
+        String home_dir = {0};
+        String_appendCStr(&home_dir, home);
+        String_appendChar(&home_dir, '/');
+        String_appendCStr(&home_dir, ".egg");
+        String_appendTerminator(&home_dir);
+        basket_indexes[0].root = home_dir.items;
+        basket_indexes[1].root = duplicate_string(".");
+    }
+
+    char* file = find_in_basket_indexes(file_name.items);
+    assert_msgf(file != NULL, "Could not find file %s in directories", file_name.items);
+    return file;
+}
+
+#define MAX_BASKET_DEPTH 64
+
+Program compile_transformation(const char* transformation, int basket_depth, Arena* scratch);
+Program load_basket(const char* path, size_t* hash, int basket_depth, Arena* scratch);
+
+// Whether a node only rewrites or shortens the string where it is.
+bool node_in_place(const Node* node) {
+    switch (node->op) {
+        case 'u':
+        case 'l':
+        case 'i':
+        case 'j':
+        case 's':
+        case 't':
+        case 'r':
+        case 'C':
+        case 'D':
+        case '-':
+        case 'L':
+        case '.':
+        case OP_BYTE_MAP:
+            return true;
+        case '\'':
+            return node->body.in_place;
+        default:
+            return false;
+    }
+}
+
+Program compile_nested_transformation(const char* transformation, size_t* i, int basket_depth, Arena* scratch) {
+    ArenaMark mark = arena_mark(scratch);
+    String trans = read_transformation(transformation, i, scratch);
+    Program program = compile_transformation(trans.items, basket_depth, scratch);
+    arena_reset(scratch, mark);
+    return program;
+}
+
+// Parses a transformation string once into a Program, so that nested transformations
+// (e.g. the body of 'E' or ':') are not re-parsed every time they are executed.
+// Baskets are read and compiled here as well. Temporary strings are allocated from `scratch`.
+void free_program(Program* program);
+void free_node(Node* node);
+
+// Fills in the table of a node that replaces every byte by exactly one byte, applied after what
+// `table` already does. Returns false, leaving the table alone, for any other node.
+static bool compose_byte_map(const Node* node, unsigned char table[256]) {
+    unsigned char map[256];
+    switch (node->op) {
+        case 'u':
+        case 'l':
+        case 'i':
+        case 'j':
+            for (int c = 0; c < 256; ++c) {
+                char b = (char) c;
+                map[c] = node->op == 'u' ? toUpper(b)
+                    : node->op == 'l' ? toLower(b)
+                    : node->op == 'i' ? (isUpper(b) ? toLower(b) : toUpper(b))
+                    : (isSpace(b) ? '_' : b);
+            }
+            break;
+        case OP_BYTE_MAP:
+            memcpy(map, node->str.items, 256);
+            break;
+        case '{':
+            {
+                const Matcher* m = &node->rules.matcher;
+                if (m->longest > 1) return false;
+                for (int c = 0; c < 256; ++c) {
+                    int r = m->byte_rule[c] >= 0 ? m->byte_rule[c] : m->empty_rule;
+                    if (r >= 0 && node->rules.items[r].to.count != 1) return false;
+                    map[c] = r >= 0 ? (unsigned char) node->rules.items[r].to.items[0] : c;
+                }
+            }
+            break;
+        case '\'':
+            // a basket that only maps bytes
+            for (int c = 0; c < 256; ++c) {
+                map[c] = c;
+            }
+            for (size_t k = 0; k < node->body.count; ++k) {
+                if (!compose_byte_map(&node->body.items[k], map)) return false;
+            }
+            break;
+        default:
+            return false;
+    }
+    for (int c = 0; c < 256; ++c) {
+        table[c] = map[table[c]];
+    }
+    return true;
+}
+
+// Replaces every run of nodes that map bytes to bytes, like `l {'a' = '4' 'e' = '3'} i j`, with one
+// node applying their combined table, so the string is gone over once instead of once per node.
+// The XOR of a '^' after such a run joins the table too, leaving the hex encoding to an 'h'.
+// A single '{' of one-byte rules becomes a table as well, which works in place.
+static void fuse_byte_maps(Program* program) {
+    size_t kept = 0;
+    for (size_t i = 0; i < program->count;) {
+        unsigned char table[256];
+        for (int c = 0; c < 256; ++c) {
+            table[c] = c;
+        }
+        size_t end = i;
+        while (end < program->count && compose_byte_map(&program->items[end], table)) {
+            end++;
+        }
+        bool xor = end > i && end < program->count && program->items[end].op == '^';
+        if (end - i + xor < 2 && !(end - i == 1 && program->items[i].op == '{')) {
+            program->items[kept++] = program->items[i++];
+            continue;
+        }
+
+        Node fused = { .op = OP_BYTE_MAP, .number = end - i + xor };
+        if (xor) {
+            for (int c = 0; c < 256; ++c) {
+                table[c] ^= 0xFF;
+            }
+            program->items[end].op = 'h';
+        }
+        String_appendMany(&fused.str, (const char*) table, 256);
+        for (size_t k = i; k < end; ++k) {
+            if (program->items[k].op == '\'') {
+                // kept, not run, so that a precompiled basket still notices when this one changes
+                List_append(&fused.body, program->items[k]);
+            } else {
+                free_node(&program->items[k]);
+            }
+        }
+        program->items[kept++] = fused;
+        i = end;
+    }
+    program->count = kept;
+}
+
+// What a compile_transformation has built so far, kept off the stack so that it can be freed
+// after a failed assertion was caught. The frames of nested compilations link to the outer ones.
+typedef struct CompileFrame {
+    Program program;
+    Node node;  // the node being parsed, not yet in `program`
+    struct CompileFrame* outer;
+} CompileFrame;
+
+EGG_THREAD_LOCAL CompileFrame* compile_frames = NULL;
+
+// Frees what the compilations interrupted by a failed assertion had built.
+void free_unfinished_programs(void) {
+    while (compile_frames) {
+        CompileFrame* frame = compile_frames;
+        compile_frames = frame->outer;
+        free_node(&frame->node);
+        free_program(&frame->program);
+        free_or_die(&frame);
+    }
+}
+
+Program compile_transformation(const char* transformation, int basket_depth, Arena* scratch) {
+    assert_msg(transformation != NULL, "Transformation must not be NULL");
+    assert_msgf(basket_depth <= MAX_BASKET_DEPTH, "Baskets are nested more than %d levels deep, does a basket reference itself?", MAX_BASKET_DEPTH);
+
+    CompileFrame* frame = malloc_or_die(sizeof(CompileFrame));
+    *frame = (CompileFrame) { .outer = compile_frames };
+    compile_frames = frame;
+    Node* node = &frame->node;
+    for (size_t i = 0; transformation[i]; ++i) {
+        *node = (Node) { .op = transformation[i] };
+
+        #define checkIncrement() do { assert_msgf(transformation[i + 1], "Transformation '%s' is incomplete at position %zu: Got 0x%02x (%c)", transformation, i, transformation[i + 1]); i++; } while (0)
+
+        switch (node->op) {
+            case ' ':
+            case '(':
+            case ')':
+            case '\t':
+            case '\n':
+            case '\r':
+                continue;
+            case 'u':
+            case 'l':
+            case 'r':
+            case 'C':
+            case 'D':
+            case 'd':
+            case 's':
+            case 't':
+            case 'j':
+            case 'e':
+            case 'n':
+            case '-':
+            case 'i':
+            case 'b':
+            case 'B':
+            case 'v':
+            case 'w':
+            case 'W':
+            case 'h':
+            case 'H':
+            case 'X':
+            case '^':
+            case 'K':
+            case '.':
+                break;
+            case 'c':
+            case 'k':
+                crc_init();
+                break;
+            case '|': // Split at(string)
+                checkIncrement();
+                read_string(transformation, &i, &node->str);
+                checkIncrement();
+                node->body = compile_nested_transformation(transformation, &i, basket_depth, scratch);
+                break;
+            case 'x': // Remove(string) or Remove{strings...}
+                checkIncrement();
+                while (isSpace(transformation[i])) checkIncrement();
+                if (transformation[i] != '{') {
+                    read_string(transformation, &i, &node->str);
+                    break;
+                }
+                // Removing is replacing with nothing, so several strings share the '{' matcher.
+                checkIncrement();
+                while (transformation[i] != '}' && transformation[i] != 0) {
+                    while (isSpace(transformation[i])) checkIncrement();
+                    List_append(&node->rules, (ReplaceRule) {0});
+                    ReplaceRule* rule = &node->rules.items[node->rules.count - 1];
+                    read_string(transformation, &i, &rule->from);
+                    checkIncrement();
+                    while (isSpace(transformation[i])) checkIncrement();
+                    if (rule->from.count == 0) {
+                        free_string(&rule->from);
+                        node->rules.count--;
+                    }
+                }
+                if (node->rules.items) {
+                    qsort(node->rules.items, node->rules.count, sizeof(ReplaceRule), sort_match_replace);
+                }
+                build_matcher(&node->rules);
+                break;
+            case 'a': // Append(string)
+            case 'p': // Prepend(string)
+                checkIncrement();
+                while (isSpace(transformation[i])) checkIncrement();
+                read_string(transformation, &i, &node->str);
+                break;
+            case 'E': // For Each Char
+            case ':': // repeat
+                checkIncrement();
+                node->body = compile_nested_transformation(transformation, &i, basket_depth, scratch);
+                break;
+            case 'L': // limit length (e.g. l10)
+                checkIncrement();
+                while (isSpace(transformation[i])) checkIncrement();
+                while (isDigit(transformation[i])) {
+                    node->number = node->number * 10 + (transformation[i] - '0');
+                    i++; // increment to skip the digit, checked by isDigit
+                }
+                i--;
+                break;
+            case '@': // only for nth char (e.g. @3)
+                checkIncrement();
+                while (isSpace(transformation[i])) checkIncrement();
+                while (isDigit(transformation[i])) {
+                    node->number = node->number * 10 + (transformation[i] - '0');
+                    i++; // increment to skip the digit, checked by isDigit
+                }
+                node->body = compile_nested_transformation(transformation, &i, basket_depth, scratch);
+                break;
+            case '\'':
+                {
+                    ArenaMark mark = arena_mark(scratch);
+                    String name = { .arena = scratch };
+                    checkIncrement();
+                    while (transformation[i] != '\'') {
+                        String_appendChar(&name, transformation[i]);
+                        checkIncrement();
+                    }
+                    String_appendTerminator(&name);
+
+                    char* file = find_basket(name.items, scratch);
+                    String_appendCStr(&node->str, file);
+                    String_appendTerminator(&node->str);
+                    free_or_die(&file);
+
+                    node->body = load_basket(node->str.items, &node->number, basket_depth + 1, scratch);
+                    arena_reset(scratch, mark);
+                }
+                break;
+            case '{': // match and replace
+                checkIncrement();
+                while (transformation[i] != '}' && transformation[i] != 0) {
+                    while (isSpace(transformation[i])) checkIncrement();
+                    List_append(&node->rules, (ReplaceRule) {0});
+                    ReplaceRule* rule = &node->rules.items[node->rules.count - 1];
+                    read_string(transformation, &i, &rule->from);
+                    checkIncrement();
+                    while (isSpace(transformation[i])) checkIncrement();
+                    checkIncrement(); // skip '='
+                    while (isSpace(transformation[i])) checkIncrement();
+                    read_string(transformation, &i, &rule->to);
+                    checkIncrement();
+                    while (isSpace(transformation[i])) checkIncrement();
+                }
+
+                if (node->rules.items) {
+                    qsort(node->rules.items, node->rules.count, sizeof(ReplaceRule), sort_match_replace);
+                }
+                build_matcher(&node->rules);
+                break;
+            case '[': // window of commands
+                checkIncrement();
+                while (isSpace(transformation[i])) checkIncrement();
+                while (transformation[i] != ']' && transformation[i] != 0) {
+                    Program window = compile_nested_transformation(transformation, &i, basket_depth, scratch);
+                    List_append(&node->windows, window);
+                    checkIncrement();
+                    while (isSpace(transformation[i])) checkIncrement();
+                }
+                break;
+
+            default:
+                assert_msgf(false, "Unknown transformation: %c", node->op);
+        }
+        #undef checkIncrement
+
+        List_append(&frame->program, *node);
+        *node = (Node) {0};
+    }
+    Program program = frame->program;
+    compile_frames = frame->outer;
+    free_or_die(&frame);
+
+    fuse_byte_maps(&program);
+    program.in_place = true;
+    for (size_t k = 0; k < program.count; ++k) {
+        program.in_place = program.in_place && node_in_place(&program.items[k]);
+    }
+    return program;
+}
+
+void free_node(Node* node) {
+    free_string(&node->str);
+    free_program(&node->body);
+    for (size_t k = 0; k < node->windows.count; ++k) {
+        free_program(&node->windows.items[k]);
+    }
+    if (node->windows.items) {
+        free_or_die(&node->windows.items);
+    }
+    for (size_t k = 0; k < node->rules.count; ++k) {
+        free_string(&node->rules.items[k].from);
+        free_string(&node->rules.items[k].to);
+    }
+    if (node->rules.items) {
+        free_or_die(&node->rules.items);
+    }
+    free_matcher(&node->rules.matcher);
+    if (node->profile) {
+        free_or_die(&node->profile);
+    }
+}
+
+void free_program(Program* program) {
+    if (program->shared) {
+        *program = (Program) {0};
+        return;
+    }
+    for (size_t i = 0; i < program->count; ++i) {
+        free_node(&program->items[i]);
+    }
+    if (program->items) {
+        free_or_die(&program->items);
+    }
+    program->count = 0;
+    program->capacity = 0;
+}
+
+// Compiled baskets by path, so that a basket used several times is compiled once per run.
+typedef struct {
+    char* path;
+    size_t hash;
+    Program program;
+} CachedBasket;
+
+typedef struct {
+    CachedBasket* items;
+    size_t count;
+    size_t capacity;
+} BasketCache;
+
+BasketCache basket_cache = {0};
+
+void free_basket_cache(void) {
+    for (size_t k = 0; k < basket_cache.count; ++k) {
+        free_or_die(&basket_cache.items[k].path);
+        free_program(&basket_cache.items[k].program);
+    }
+    if (basket_cache.items) {
+        free_or_die(&basket_cache.items);
+    }
+    basket_cache = (BasketCache) {0};
+}
+
+// Precompiled baskets, written by --compile next to the basket as <name>.eggc.
+// The file holds the compiled program as it is in memory, matchers included, in the byte order
+// of the machine that wrote it. It is only used while the hash of the basket text stored in it,
+// and those of the baskets it uses, still match the files, and the checksum of the program
+// stored before it matches too, so a damaged file is parsed from the basket text instead.
+#define COMPILED_BASKET_MAGIC "EGGC"
+#define COMPILED_BASKET_VERSION 3
+
+bool compiled_basket_path(const char* path, String* out) {
+    size_t len = strlen(path);
+    size_t suffix = strlen(".basket");
+    if (len < suffix || strcmp(path + len - suffix, ".basket") != 0) {
+        return false;
+    }
+    String_appendMany(out, path, len - suffix);
+    String_appendCStr(out, ".eggc");
+    String_appendTerminator(out);
+    return true;
+}
+
+static void put_bytes(String* out, const void* data, size_t len) {
+    if (len > 0) String_appendMany(out, (const char*) data, len);
+}
+
+static void put_size(String* out, uint64_t value) {
+    put_bytes(out, &value, sizeof(value));
+}
+
+static void put_string(String* out, const String* str) {
+    put_size(out, str->count);
+    put_bytes(out, str->items, str->count);
+}
+
+static void put_program(String* out, const Program* program) {
+    put_size(out, program->count);
+    put_bytes(out, &(unsigned char) { program->in_place }, 1);
+    for (size_t i = 0; i < program->count; ++i) {
+        const Node* node = &program->items[i];
+        put_bytes(out, &node->op, 1);
+        put_string(out, &node->str);
+        put_size(out, node->number);
+        put_program(out, &node->body);
+        put_size(out, node->windows.count);
+        for (size_t k = 0; k < node->windows.count; ++k) {
+            put_program(out, &node->windows.items[k]);
+        }
+        put_size(out, node->rules.count);
+        for (size_t k = 0; k < node->rules.count; ++k) {
+            put_string(out, &node->rules.items[k].from);
+            put_string(out, &node->rules.items[k].to);
+        }
+        const Matcher* m = &node->rules.matcher;
+        put_size(out, m->longest);
+        put_bytes(out, &m->empty_rule, sizeof(m->empty_rule));
+        put_bytes(out, m->byte_rule, sizeof(m->byte_rule));
+        put_bytes(out, m->byte_class, sizeof(m->byte_class));
+        put_size(out, m->class_count);
+        put_size(out, m->state_count);
+        if (m->next) {
+            put_bytes(out, m->next, m->state_count * m->class_count * sizeof(int));
+            put_bytes(out, m->rule, m->state_count * sizeof(int));
+            put_bytes(out, m->output, m->state_count * sizeof(int));
+        }
+    }
+}
+
+typedef struct {
+    const char* data;
+    size_t size;
+    size_t offset;
+    bool valid; // false once something was cut off or out of range
+} BasketReader;
+
+static void get_bytes(BasketReader* in, void* out, size_t len) {
+    if (!in->valid || len > in->size - in->offset) {
+        in->valid = false;
+        memset(out, 0, len);
+        return;
+    }
+    memcpy(out, in->data + in->offset, len);
+    in->offset += len;
+}
+
+static uint64_t get_size(BasketReader* in) {
+    uint64_t value;
+    get_bytes(in, &value, sizeof(value));
+    return value;
+}
+
+static void get_string(BasketReader* in, String* str) {
+    uint64_t len = get_size(in);
+    if (!in->valid || len > in->size - in->offset) {
+        in->valid = false;
+        return;
+    }
+    put_bytes(str, in->data + in->offset, len);
+    in->offset += len;
+}
+
+// Reads an int array of `count` entries, each in [min, max).
+static int* get_ints(BasketReader* in, uint64_t count, int min, uint64_t max) {
+    if (!in->valid || count > (in->size - in->offset) / sizeof(int)) {
+        in->valid = false;
+        return NULL;
+    }
+    int* values = malloc_or_die(count * sizeof(int) + 1);
+    get_bytes(in, values, count * sizeof(int));
+    for (uint64_t k = 0; k < count; ++k) {
+        in->valid = in->valid && values[k] >= min && (values[k] < 0 || (uint64_t) values[k] < max);
+    }
+    return values;
+}
+
+bool basket_text_unchanged(const char* path, size_t hash);
+
+// The operators compile_transformation leaves in a program.
+#define COMPILED_OPS "ulrCDdstjen-ibBvwWhHX^Kck.|xapE:L@'{[#"
+
+// Reads a program written by put_program. The file may come from anywhere, so everything in it is
+// checked before it is used, and what can be derived from the nodes, like `in_place`, is derived again.
+// Programs nested deeper than `depth` allows are rejected rather than read recursively.
+static void get_program(BasketReader* in, Program* program, int depth) {
+    if (depth > MAX_BASKET_DEPTH) {
+        in->valid = false;
+        return;
+    }
+    uint64_t count = get_size(in);
+    unsigned char in_place;
+    get_bytes(in, &in_place, 1); // not trusted, see below
+    for (uint64_t i = 0; i < count && in->valid; ++i) {
+        Node node = {0};
+        get_bytes(in, &node.op, 1);
+        in->valid = in->valid && node.op != 0 && strchr(COMPILED_OPS, node.op) != NULL;
+        get_string(in, &node.str);
+        node.number = get_size(in);
+        get_program(in, &node.body, depth + 1);
+        uint64_t windows = get_size(in);
+        for (uint64_t k = 0; k < windows && in->valid; ++k) {
+            Program window = {0};
+            get_program(in, &window, depth + 1);
+            List_append(&node.windows, window);
+        }
+        uint64_t rules = get_size(in);
+        for (uint64_t k = 0; k < rules && in->valid; ++k) {
+            ReplaceRule rule = {0};
+            get_string(in, &rule.from);
+            get_string(in, &rule.to);
+            List_append(&node.rules, rule);
+        }
+        Matcher* m = &node.rules.matcher;
+        m->longest = get_size(in);
+        get_bytes(in, &m->empty_rule, sizeof(m->empty_rule));
+        get_bytes(in, m->byte_rule, sizeof(m->byte_rule));
+        get_bytes(in, m->byte_class, sizeof(m->byte_class));
+        m->class_count = get_size(in);
+        m->state_count = get_size(in);
+        if (m->class_count == 0) {
+            // no matcher, which only '{' and 'x' with rules need
+            in->valid = in->valid && node.op != '{' && rules == 0 && m->longest == 0 && m->state_count == 0;
+            *m = (Matcher) {0};
+        } else {
+            // the longest rule sizes the buffers of replace_rules, so it must be the real one
+            size_t longest = 0;
+            for (size_t k = 0; k < node.rules.count; ++k) {
+                if (node.rules.items[k].from.count > longest) longest = node.rules.items[k].from.count;
+            }
+            in->valid = in->valid && m->class_count <= 256 && rules <= INT32_MAX && m->longest == longest
+                && m->empty_rule >= -1 && m->empty_rule < (int64_t) rules;
+        }
+        for (size_t c = 0; c < 256 && in->valid && m->class_count > 0; ++c) {
+            in->valid = m->byte_class[c] < m->class_count && m->byte_rule[c] >= -1 && m->byte_rule[c] < (int64_t) rules;
+        }
+        if (in->valid && m->class_count > 0 && m->longest > 1) {
+            uint64_t states = m->state_count;
+            in->valid = states >= 1 && states <= (in->size - in->offset) / sizeof(int) / m->class_count;
+            m->next = get_ints(in, states * m->class_count, 0, states);
+            m->rule = get_ints(in, states, -1, rules);
+            m->output = get_ints(in, states, -1, states);
+        }
+        if (node.op == OP_BYTE_MAP) {
+            in->valid = in->valid && node.str.count == 256;
+        }
+        if (node.op == '\'') {
+            // a basket used by this one, which must not have changed either
+            in->valid = in->valid && node.str.count > 0 && node.str.items[node.str.count - 1] == '\0'
+                && basket_text_unchanged(node.str.items, node.number);
+        }
+        List_append(program, node);
+    }
+    program->in_place = true;
+    for (size_t k = 0; k < program->count; ++k) {
+        program->in_place = program->in_place && node_in_place(&program->items[k]);
+    }
+}
+
+void write_compiled_basket(const char* path) {
+    String compiled = {0};
+    assert_msgf(compiled_basket_path(path, &compiled), "%s is not a .basket file", path);
+
+    char* text = file_contents_without_lines_with_hash(path);
+    Arena scratch = {0};
+    Program program = compile_transformation(text, 1, &scratch);
+    arena_free(&scratch);
+
+    String out = {0};
+    put_bytes(&out, COMPILED_BASKET_MAGIC, 4);
+    put_size(&out, COMPILED_BASKET_VERSION);
+    put_size(&out, 0x0102030405060708ULL); // byte order
+    put_size(&out, fnv1a(text, strlen(text)));
+    String body = {0};
+    put_program(&body, &program);
+    put_size(&out, fnv1a(body.items, body.count));
+    put_bytes(&out, body.items, body.count);
+    free_string(&body);
+
+    FILE* file = fopen_or_die(compiled.items, "wb");
+    assert_msgf(fwrite(out.items, 1, out.count, file) == out.count, "Could not write %s", compiled.items);
+    fclose_or_die(&file);
+
+    free_program(&program);
+    free_or_die(&text);
+    free_string(&out);
+    free_string(&compiled);
+}
+
+// Loads the compiled form of the basket at `path` if there is an up-to-date one.
+bool load_compiled_basket(const char* path, size_t hash, Program* program) {
+#ifndef _WIN32
+    String compiled = {0};
+    if (!compiled_basket_path(path, &compiled)) {
+        return false;
+    }
+    int fd = open(compiled.items, O_RDONLY);
+    free_string(&compiled);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void* data = fstat(fd, &st) == 0 && st.st_size > 0
+        ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    BasketReader in = { .data = data, .size = st.st_size, .valid = true };
+    char magic[4];
+    get_bytes(&in, magic, 4);
+    in.valid = in.valid && memcmp(magic, COMPILED_BASKET_MAGIC, 4) == 0
+        && get_size(&in) == COMPILED_BASKET_VERSION
+        && get_size(&in) == 0x0102030405060708ULL
+        && get_size(&in) == hash;
+    uint64_t checksum = get_size(&in);
+    in.valid = in.valid && fnv1a(in.data + in.offset, in.size - in.offset) == checksum;
+    get_program(&in, program, 0);
+    in.valid = in.valid && in.offset == in.size;
+    munmap(data, st.st_size);
+    if (!in.valid) {
+        free_program(program);
+    }
+    return in.valid;
+#else
+    (void) path;
+    (void) hash;
+    (void) program;
+    return false;
+#endif
+}
+
+bool basket_text_unchanged(const char* path, size_t hash) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    fclose_or_die(&file);
+    char* text = file_contents_without_lines_with_hash(path);
+    bool unchanged = fnv1a(text, strlen(text)) == hash;
+    free_or_die(&text);
+    return unchanged;
+}
+
+// Compiles the basket at `path`, or takes it from the cache or its precompiled form. The program
+// belongs to the cache, so it is marked as shared. `*hash` is set to the hash of the basket text.
+Program load_basket(const char* path, size_t* hash, int basket_depth, Arena* scratch) {
+    for (size_t k = 0; k < basket_cache.count; ++k) {
+        if (strcmp(basket_cache.items[k].path, path) == 0) {
+            *hash = basket_cache.items[k].hash;
+            Program program = basket_cache.items[k].program;
+            program.shared = true;
+            return program;
+        }
+    }
+
+    // the text is kept in `scratch`, so that it is not lost when compiling it fails
+    ArenaMark mark = arena_mark(scratch);
+    char* file_text = file_contents_without_lines_with_hash(path);
+    size_t len = strlen(file_text);
+    char* text = arena_alloc(scratch, len + 1);
+    memcpy(text, file_text, len + 1);
+    free_or_die(&file_text);
+
+    CachedBasket basket = { .hash = fnv1a(text, len) };
+    if (!load_compiled_basket(path, basket.hash, &basket.program)) {
+        basket.program = compile_transformation(text, basket_depth, scratch);
+    }
+    arena_reset(scratch, mark);
+    basket.path = duplicate_string(path);
+    List_append(&basket_cache, basket);
+
+    *hash = basket.hash;
+    Program program = basket.program;
+    program.shared = true;
+    return program;
+}
+
+
+// State threaded through the executor. `spare` is the other half of a double buffer:
+// nodes that cannot work in place write their result to it and swap it with the current
+// string, so once both buffers are large enough running a program does not allocate.
+struct Context {
+    String spare;
+    Arena arena;             // buffers of the programs running at this nesting level
+    Arena scratch;           // working memory of a single node, never holding a buffer that outlives it
+    struct Context* nested;  // context for the sub-programs of 'E', '[', '@' and '|'
+    String* batches;         // results of the batches of a parallel transform_pieces
+    size_t batch_capacity;
+    String characters;       // results of the characters of a transform_pieces, see transform_characters
+    String checkpoint;       // an earlier result of a ':', to notice when its results repeat
+};
+
+// Makes the result written to the spare buffer the current string.
+void swap_spare(String* str, Context* ctx) {
+    String temp = *str;
+    *str = ctx->spare;
+    ctx->spare = temp;
+}
+
+void free_context(Context* ctx) {
+    free_string(&ctx->spare);
+    arena_free(&ctx->arena);
+    arena_free(&ctx->scratch);
+    for (size_t k = 0; k < ctx->batch_capacity; ++k) {
+        free_string(&ctx->batches[k]);
+    }
+    if (ctx->batches) {
+        free_or_die(&ctx->batches);
+    }
+    free_string(&ctx->characters);
+    free_string(&ctx->checkpoint);
+    if (ctx->nested) {
+        free_context(ctx->nested);
+        free_or_die(&ctx->nested);
+    }
+}
+
+// Number of threads for parallel work, including the calling one. 0 means one per processor.
+// Programs using the library run their own threads, so it does not start any.
+#ifdef EGG_LIBRARY
+size_t requested_threads = 1;
+#else
+size_t requested_threads = 0;
+#endif
+
+size_t thread_count(void) {
+    if (requested_threads == 0) {
+#ifdef _WIN32
+        requested_threads = 1;
+#else
+        long processors = sysconf(_SC_NPROCESSORS_ONLN);
+        requested_threads = processors > 0 ? (size_t) processors : 1;
+#endif
+    }
+    return requested_threads;
+}
+
+#ifndef _WIN32
+// Worker threads that, together with the thread that posts a job, take its batches one after
+// another until none are left, so threads that finish early simply take more of them.
+// Only one job runs at a time; a job posted while another one is running (from a batch of it,
+// or from another thread) runs on the posting thread instead.
+// A failed assertion in a batch ends the job, and is raised again on the posting thread once the
+// batches already running are done, so that it can be caught there (see error_jump).
+typedef struct ThreadPool {
+    size_t size;              // worker threads
+    pthread_t* threads;
+    Context* contexts;        // one per worker, kept for the arenas
+    pthread_mutex_t lock;
+    pthread_cond_t posted;    // a job was posted, or the pool is stopping
+    pthread_cond_t finished;  // the last batch of the job is done
+    BatchFunction function;   // NULL while there is no job
+    void* job;
+    size_t batch_count;
+    size_t next_batch;
+    size_t done_batches;
+    bool failed;              // a batch of the job failed, error holds its message
+    char error[sizeof(error_message)];
+    bool stopping;
+} ThreadPool;
+
+ThreadPool pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .posted = PTHREAD_COND_INITIALIZER, .finished = PTHREAD_COND_INITIALIZER };
+
+// Runs a batch, returning false if an assertion failed in it.
+// The context is left as the batch left it; it may belong to the posting thread, whose
+// buffers other threads are still writing to, so only a worker resets its own (see pool_worker).
+static bool pool_run_batch(BatchFunction function, void* job, size_t batch, Context* ctx) {
+    jmp_buf* outer = error_jump;
+    jmp_buf jump;
+    if (setjmp(jump) == 0) {
+        error_jump = &jump;
+        function(job, batch, ctx);
+        error_jump = outer;
+        return true;
+    }
+    error_jump = outer;
+    return false;
+}
+
+// Takes and runs batches of the current job until there are none left. Called with the lock held.
+// Returns false if one of the batches run by this thread failed.
+static bool pool_work(Context* ctx) {
+    bool all_ok = true;
+    while (pool.function && pool.next_batch < pool.batch_count) {
+        size_t batch = pool.next_batch++;
+        BatchFunction function = pool.function;
+        void* job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+        bool ok = pool_run_batch(function, job, batch, ctx);
+        pthread_mutex_lock(&pool.lock);
+        all_ok = all_ok && ok;
+        if (!ok && !pool.failed) {
+            // skip the batches nobody has taken yet
+            pool.failed = true;
+            memcpy(pool.error, error_message, sizeof(pool.error));
+            pool.done_batches += pool.batch_count - pool.next_batch;
+            pool.next_batch = pool.batch_count;
+        }
+        if (++pool.done_batches == pool.batch_count) {
+            pthread_cond_broadcast(&pool.finished);
+        }
+    }
+    return all_ok;
+}
+
+static void* pool_worker(void* arg) {
+    Context* ctx = arg;
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.stopping) {
+        if (!pool_work(ctx)) {
+            // a failed batch may have left the context in the middle of something
+            free_context(ctx);
+            *ctx = (Context) {0};
+        }
+        pthread_cond_wait(&pool.posted, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+static void pool_start(size_t workers) {
+    pool.threads = malloc_or_die(workers * sizeof(pthread_t));
+    pool.contexts = malloc_or_die(workers * sizeof(Context));
+    for (; pool.size < workers; ++pool.size) {
+        pool.contexts[pool.size] = (Context) {0};
+        if (pthread_create(&pool.threads[pool.size], NULL, pool_worker, &pool.contexts[pool.size]) != 0) {
+            break; // make do with the threads we got
+        }
+    }
+}
+
+void pool_stop(void) {
+    if (!pool.threads) return;
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.posted);
+    pthread_mutex_unlock(&pool.lock);
+    for (size_t k = 0; k < pool.size; ++k) {
+        pthread_join(pool.threads[k], NULL);
+        free_context(&pool.contexts[k]);
+    }
+    free_or_die(&pool.threads);
+    free_or_die(&pool.contexts);
+    pool.size = 0;
+}
+#else
+void pool_stop(void) {}
+#endif
+
+void run_batches(BatchFunction function, void* job, size_t batch_count, Context* ctx) {
+#ifndef _WIN32
+    if (batch_count > 1 && thread_count() > 1) {
+        pthread_mutex_lock(&pool.lock);
+        if (!pool.threads) {
+            pool_start(thread_count() - 1);
+        }
+        if (!pool.function && pool.size > 0) {
+            pool.function = function;
+            pool.job = job;
+            pool.batch_count = batch_count;
+            pool.next_batch = 0;
+            pool.done_batches = 0;
+            pool.failed = false;
+            pthread_cond_broadcast(&pool.posted);
+            pool_work(ctx);
+            while (pool.done_batches < pool.batch_count) {
+                pthread_cond_wait(&pool.finished, &pool.lock);
+            }
+            pool.function = NULL;
+            bool failed = pool.failed;
+            char error[sizeof(pool.error)];
+            memcpy(error, pool.error, sizeof(error));
+            pthread_mutex_unlock(&pool.lock);
+            _assert_msgf(!failed, "%s", error); // already a full assertion message
+            return;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+#endif
+    for (size_t batch = 0; batch < batch_count; ++batch) {
+        function(job, batch, ctx);
+    }
+}
+
+void run_program(const Program* program, String* str, Context* ctx);
+
+// Finds the first occurrence of `needle` in `haystack`, or returns NULL.
+const char* find_string(const char* haystack, size_t len, const String* needle) {
+    if (needle->count == 0 || needle->count > len) {
+        return NULL;
+    }
+    const char* p = haystack;
+    if (needle->count > 1) {
+        bool found = false;
+        p += simd_find(haystack, len, needle->items, needle->count, &found);
+        if (found) {
+            return p;
+        }
+    }
+    const char* end = haystack + len - needle->count + 1;
+    while ((p = memchr(p, needle->items[0], end - p)) != NULL) {
+        if (memcmp(p, needle->items, needle->count) == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+// Whether `pattern` occurs at `input[j]`.
+static inline bool matches_at(const char* input, size_t len, size_t j, const String* pattern) {
+    return pattern->count == 0
+        || (pattern->count <= len - j && memcmp(&input[j], pattern->items, pattern->count) == 0);
+}
+
+// Removes every occurrence of `needle` starting before `stop`, appending the kept bytes to `out`.
+// Returns how many bytes of `input` were consumed.
+size_t remove_string(const char* input, size_t len, size_t stop, const String* needle, String* out) {
+    String_reserve(out, out->count + stop);
+    if (needle->count == 1) {
+        char c = needle->items[0];
+        size_t k = out->count;
+        size_t j = simd_remove_byte(input, stop, c, out->items, &k);
+        for (; j < stop; ++j) {
+            if (input[j] != c) out->items[k++] = input[j];
+        }
+        out->count = k;
+        return stop;
+    }
+
+    size_t j = 0;
+    while (j < stop) {
+        const char* match = find_string(input + j, len - j, needle);
+        size_t at = match ? (size_t) (match - input) : stop;
+        if (at >= stop) {
+            String_appendMany(out, input + j, stop - j);
+            return stop;
+        }
+        String_appendMany(out, input + j, at - j);
+        j = at + needle->count; // skip the string to remove
+    }
+    return j;
+}
+
+// Applies the longest matching rule at every position before `stop`, appending the result to `out`.
+// Returns how many bytes of `input` were consumed.
+size_t replace_rules(const char* input, size_t len, size_t stop, const ReplaceRules* rules, String* out, Context* ctx) {
+    const Matcher* m = &rules->matcher;
+    const ReplaceRule* empty = m->empty_rule >= 0 ? &rules->items[m->empty_rule] : NULL;
+    String_reserve(out, out->count + len);
+    size_t j = 0;
+    size_t copy_from = 0; // start of the unmatched bytes not yet appended
+
+    if (m->longest <= 1) {
+        for (; j < stop; ++j) {
+            int r = m->byte_rule[(unsigned char) input[j]];
+            const ReplaceRule* rule = r >= 0 ? &rules->items[r] : empty;
+            if (rule) {
+                String_appendMany(out, input + copy_from, j - copy_from);
+                String_appendMany(out, rule->to.items, rule->to.count);
+                copy_from = j + 1;
+            }
+        }
+        String_appendMany(out, input + copy_from, j - copy_from);
+        return j;
+    }
+
+    // best[s % longest] is the longest rule found so far that starts at s, for s in [j, j + longest).
+    // The automaton runs ahead until every match starting at j must have been seen.
+    ArenaMark mark = arena_mark(&ctx->scratch);
+    size_t window = m->longest;
+    int* best = arena_alloc(&ctx->scratch, window * sizeof(int));
+    for (size_t k = 0; k < window; ++k) best[k] = -1;
+
+    int state = 0;
+    size_t end = 0; // next byte to feed the automaton
+    while (j < stop) {
+        for (; end < len && end < j + window; ++end) {
+            state = m->next[state * m->class_count + m->byte_class[(unsigned char) input[end]]];
+            for (int o = m->rule[state] >= 0 ? state : m->output[state]; o >= 0; o = m->output[o]) {
+                int r = m->rule[o];
+                size_t start = end + 1 - rules->items[r].from.count;
+                if (start >= j) {
+                    best[start % window] = r; // later matches with the same start are longer
+                }
+            }
+        }
+
+        int r = best[j % window];
+        best[j % window] = -1;
+        if (r >= 0 || empty) {
+            const ReplaceRule* rule = r >= 0 ? &rules->items[r] : empty;
+            size_t skip = r >= 0 ? rule->from.count : 1;
+            String_appendMany(out, input + copy_from, j - copy_from);
+            String_appendMany(out, rule->to.items, rule->to.count);
+            for (size_t k = 1; k < skip; ++k) {
+                best[(j + k) % window] = -1;
+            }
+            j += skip;
+            copy_from = j;
+        } else {
+            j++;
+        }
+    }
+    String_appendMany(out, input + copy_from, j - copy_from);
+    arena_reset(&ctx->scratch, mark);
+    return j;
+}
+
+// Runs `program` on a copy of `len` bytes of `input` and appends the result to `out`.
+// The copy and the buffers used while transforming it come from the arena of the nested
+// context, which is reset afterwards, so running a sub-program for every character or
+// segment does not call malloc/free.
+void run_program_on(const Program* program, const char* input, size_t len, String* out, Context* ctx) {
+    if (!ctx->nested) {
+        ctx->nested = malloc_or_die(sizeof(Context));
+        *ctx->nested = (Context) {0};
+    }
+    Context* nested = ctx->nested;
+
+    if (program->in_place) {
+        // Nothing can grow the string, so it is transformed right where it is appended to `out`.
+        if (len == 0) return;
+        size_t start = out->count;
+        String_appendMany(out, input, len);
+        String view = { .items = out->items + start, .count = len, .capacity = len };
+        run_program(program, &view, nested);
+        out->count = start + view.count;
+        return;
+    }
+
+    ArenaMark mark = arena_mark(&nested->arena);
+
+    String part = { .arena = &nested->arena };
+    nested->spare = (String) { .arena = &nested->arena };
+    String_appendMany(&part, input, len);
+    run_program(program, &part, nested);
+    String_appendMany(out, part.items, part.count);
+
+    arena_reset(&nested->arena, mark);
+    nested->spare = (String) {0};
+}
+
+// Output is written to standard output with plain write calls, without going through stdio,
+// so each buffer is written in one go and pieces kept in separate buffers need no concatenating.
+#define OUTPUT_BLOCK_MAX (1 << 30)
+
+void write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        int written = write(fd, data, len > OUTPUT_BLOCK_MAX ? OUTPUT_BLOCK_MAX : len);
+        if (written < 0 && errno == EINTR) continue;
+        assert_msg(written > 0, "Could not write the output");
+        data += written;
+        len -= written;
+    }
+}
+
+void write_output(const char* data, size_t len) {
+    write_all(STDOUT_FILENO, data, len);
+}
+
+#ifndef _WIN32
+#define OUTPUT_IOV_MAX 64
+
+// Writes the contents of `count` strings one after another, handing them to writev in groups.
+void write_outputs(const String* pieces, size_t count) {
+    struct iovec iov[OUTPUT_IOV_MAX];
+    size_t next = 0;
+    while (next < count) {
+        int iov_count = 0;
+        size_t total = 0;
+        for (; next < count && iov_count < OUTPUT_IOV_MAX; ++next) {
+            if (pieces[next].count > 0 && total + pieces[next].count <= OUTPUT_BLOCK_MAX) {
+                iov[iov_count++] = (struct iovec) { .iov_base = pieces[next].items, .iov_len = pieces[next].count };
+                total += pieces[next].count;
+            } else if (pieces[next].count > 0) {
+                break;
+            }
+        }
+        if (iov_count == 0 && next < count) {
+            write_output(pieces[next].items, pieces[next].count); // too big to share a writev
+            next++;
+        }
+
+        int first = 0;
+        while (first < iov_count) {
+            int written = writev(STDOUT_FILENO, iov + first, iov_count - first);
+            if (written < 0 && errno == EINTR) continue;
+            assert_msg(written > 0, "Could not write the output");
+            // skip what was written, which can end in the middle of a piece
+            while (first < iov_count && (size_t) written >= iov[first].iov_len) {
+                written -= iov[first].iov_len;
+                first++;
+            }
+            if (first < iov_count) {
+                iov[first].iov_base = (char*) iov[first].iov_base + written;
+                iov[first].iov_len -= written;
+            }
+        }
+    }
+}
+#else
+void write_outputs(const String* pieces, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        write_output(pieces[k].items, pieces[k].count);
+    }
+}
+#endif
+
+// Pieces of the input that the body of an 'E', '[' or '|' node transforms independently of each other.
+typedef struct PieceJob {
+    const Program* programs;  // piece k runs through programs[(offset + k) % program_count]
+    size_t program_count;
+    size_t offset;
+    const char* input;
+    const size_t* starts;     // NULL when every piece is a single character
+    const size_t* lens;
+    size_t count;
+    const String* delimiter;  // if set, written between pieces, and before the first one if `joined`
+    bool joined;
+    bool terminated;          // the delimiter is written after every piece instead
+    bool to_output;           // batch results are written to the output right away instead of to `out`
+    size_t batch_size;
+    String* results;          // one per batch, when running on the thread pool
+} PieceJob;
+
+#define PIECES_PER_BATCH 64
+#define SEGMENTS_PER_ROUND 65536
+#define CHARACTERS_PER_TABLE_ENTRY 64
+
+static void transform_batch(const PieceJob* job, size_t batch, String* out, Context* ctx) {
+    size_t first = batch * job->batch_size;
+    size_t end = job->count - first > job->batch_size ? first + job->batch_size : job->count;
+    for (size_t k = first; k < end; ++k) {
+        if (job->delimiter && !job->terminated && (k > 0 || job->joined)) {
+            String_appendMany(out, job->delimiter->items, job->delimiter->count);
+        }
+        const Program* program = &job->programs[(job->offset + k) % job->program_count];
+        if (job->starts) {
+            run_program_on(program, job->input + job->starts[k], job->lens[k], out, ctx);
+        } else {
+            run_program_on(program, &job->input[k], 1, out, ctx);
+        }
+        if (job->terminated) {
+            String_appendMany(out, job->delimiter->items, job->delimiter->count);
+        }
+    }
+}
+
+static void transform_pooled_batch(void* arg, size_t batch, Context* ctx) {
+    PieceJob* job = arg;
+    job->results[batch].count = 0;
+    transform_batch(job, batch, &job->results[batch], ctx);
+}
+
+// What a character turns into at a position, as a slice of `Context.characters`.
+// Results of up to 8 bytes are kept in `head` too, so that they are copied 8 bytes at a time.
+typedef struct {
+    size_t start;
+    size_t len;  // SIZE_MAX until the character was transformed
+    char head[8];
+} CharacterResult;
+
+// Transforms the single characters of `job`. The result of a character only depends on its value
+// and on which of the programs it runs through, so each of the 256 * program_count combinations
+// is transformed the first time it occurs, and all others are copied from the table of results.
+// As the combinations are met in input order, an input that makes a program fail still fails at
+// the first character it would have failed at.
+static void transform_characters(const PieceJob* job, String* out, Context* ctx) {
+    size_t entries = job->program_count * 256;
+    ArenaMark mark = arena_mark(&ctx->scratch);
+    CharacterResult* table = arena_alloc(&ctx->scratch, entries * sizeof(CharacterResult));
+    for (size_t e = 0; e < entries; ++e) {
+        table[e] = (CharacterResult) { .len = SIZE_MAX };
+    }
+    String* results = &ctx->characters;
+    results->count = 0;
+
+    const unsigned char* input = (const unsigned char*) job->input;
+    size_t total = 0;
+    size_t longest = 0;
+    size_t window = job->offset % job->program_count;
+    for (size_t k = 0; k < job->count; ++k) {
+        CharacterResult* entry = &table[window * 256 + input[k]];
+        if (entry->len == SIZE_MAX) {
+            entry->start = results->count;
+            run_program_on(&job->programs[window], (const char*) &input[k], 1, results, ctx);
+            entry->len = results->count - entry->start;
+            if (entry->len > longest) longest = entry->len;
+        }
+        total += entry->len;
+        if (++window == job->program_count) window = 0;
+    }
+
+    if (job->program_count == 1 && longest == 1 && total == job->count) {
+        // a byte map, e.g. E(u): the characters are mapped where they are appended
+        unsigned char map[256];
+        for (size_t c = 0; c < 256; ++c) {
+            map[c] = table[c].len == 1 ? (unsigned char) results->items[table[c].start] : (unsigned char) c;
+        }
+        size_t start = out->count;
+        String_appendMany(out, job->input, job->count);
+        String view = { .items = out->items + start, .count = job->count, .capacity = job->count };
+        tf_byte_map(&view, map);
+    } else if (total > 0 && longest <= sizeof(table->head)) {
+        for (size_t e = 0; e < entries; ++e) {
+            if (table[e].len != SIZE_MAX && table[e].len > 0) {
+                memcpy(table[e].head, results->items + table[e].start, table[e].len);
+            }
+        }
+        // every copy may write up to 8 bytes, the ones after the result are overwritten by the next
+        String_reserve(out, out->count + total + sizeof(table->head));
+        char* to = out->items + out->count;
+        window = job->offset % job->program_count;
+        for (size_t k = 0; k < job->count; ++k) {
+            const CharacterResult* entry = &table[window * 256 + input[k]];
+            memcpy(to, entry->head, sizeof(entry->head));
+            to += entry->len;
+            if (++window == job->program_count) window = 0;
+        }
+        out->count += total;
+    } else if (total > 0) {
+        String_reserve(out, out->count + total);
+        char* to = out->items + out->count;
+        window = job->offset % job->program_count;
+        for (size_t k = 0; k < job->count; ++k) {
+            const CharacterResult* entry = &table[window * 256 + input[k]];
+            if (entry->len > 0) {
+                memcpy(to, results->items + entry->start, entry->len);
+                to += entry->len;
+            }
+            if (++window == job->program_count) window = 0;
+        }
+        out->count += total;
+    }
+    arena_reset(&ctx->scratch, mark);
+}
+
+// Transforms the pieces of `job` and appends the results to `out`, in order.
+// Single characters go through transform_characters once there are enough of them.
+// With more than one thread, batches of pieces are transformed on the thread pool into
+// buffers kept in `ctx`, which are then copied to `out`, or written out directly together
+// with what `out` holds so far if `to_output` is set.
+void transform_pieces(PieceJob* job, String* out, Context* ctx) {
+    if (!job->starts && !job->delimiter && job->count >= job->program_count * CHARACTERS_PER_TABLE_ENTRY) {
+        transform_characters(job, out, ctx);
+        return;
+    }
+    size_t threads = thread_count();
+    job->batch_size = job->count / (threads * 8);
+    if (job->batch_size < PIECES_PER_BATCH) job->batch_size = PIECES_PER_BATCH;
+    size_t batch_count = (job->count + job->batch_size - 1) / job->batch_size;
+    if (threads == 1 || batch_count < 2) {
+        job->batch_size = job->count;
+        transform_batch(job, 0, out, ctx);
+        return;
+    }
+
+    if (ctx->batch_capacity < batch_count) {
+        ctx->batches = realloc_or_die(ctx->batches, batch_count * sizeof(String));
+        for (; ctx->batch_capacity < batch_count; ++ctx->batch_capacity) {
+            ctx->batches[ctx->batch_capacity] = (String) {0};
+        }
+    }
+    job->results = ctx->batches;
+    run_batches(transform_pooled_batch, job, batch_count, ctx);
+    if (job->to_output) {
+        write_output(out->items, out->count);
+        out->count = 0;
+        write_outputs(job->results, batch_count);
+        return;
+    }
+    for (size_t batch = 0; batch < batch_count; ++batch) {
+        String_appendMany(out, job->results[batch].items, job->results[batch].count);
+    }
+}
+
+// Transforms the non-empty segments between the delimiters of a '|' node and appends them to `out`,
+// joined by the delimiter. `*joined` tracks whether a segment was already written.
+// Unless `eof` is set, the text after the last delimiter is left unconsumed.
+// No delimiter starts before `searched`, which was already looked through.
+// Returns how many bytes of `input` were consumed.
+size_t split_segments(const Node* node, const char* input, size_t len, bool eof, bool* joined, size_t searched, String* out, Context* ctx) {
+    const String* splitStr = &node->str;
+    PieceJob job = { .programs = &node->body, .program_count = 1, .input = input };
+
+    if (splitStr->count == 0) {
+        // Special case: split into individual characters
+        job.count = len;
+        transform_pieces(&job, out, ctx);
+        return len;
+    }
+
+    // Segments are collected a round at a time, so the lists stay small on huge inputs.
+    ArenaMark mark = arena_mark(&ctx->scratch);
+    size_t* starts = arena_alloc(&ctx->scratch, SEGMENTS_PER_ROUND * sizeof(size_t));
+    size_t* lens = arena_alloc(&ctx->scratch, SEGMENTS_PER_ROUND * sizeof(size_t));
+    job.starts = starts;
+    job.lens = lens;
+    job.delimiter = splitStr;
+
+    size_t start = 0;
+    do {
+        job.count = 0;
+        while (start < len && job.count < SEGMENTS_PER_ROUND) {
+            size_t from = start < searched ? searched : start;
+            const char* next = find_string(input + from, len - from, splitStr);
+            if (!next && !eof) {
+                break;
+            }
+            size_t segment_len = next ? (size_t) (next - (input + start)) : len - start;
+            if (segment_len > 0) {
+                starts[job.count] = start;
+                lens[job.count++] = segment_len;
+            }
+            start += segment_len + (next ? splitStr->count : 0);
+        }
+        job.joined = *joined;
+        transform_pieces(&job, out, ctx);
+        *joined = *joined || job.count > 0;
+    } while (job.count == SEGMENTS_PER_ROUND);
+
+    arena_reset(&ctx->scratch, mark);
+    return start;
+}
+
+// Transforms every record of `input` that ends with `delimiter` separately and appends each result,
+// followed by the delimiter, to `out`. At `eof` the text after the last delimiter is a record too,
+// written without one. Records transformed on the thread pool go to the output directly, after
+// what `out` holds by then. Returns how many bytes of `input` were consumed.
+size_t transform_records(const Program* program, const String* delimiter, const char* input, size_t len, bool eof, String* out, Context* ctx) {
+    ArenaMark mark = arena_mark(&ctx->scratch);
+    size_t* starts = arena_alloc(&ctx->scratch, SEGMENTS_PER_ROUND * sizeof(size_t));
+    size_t* lens = arena_alloc(&ctx->scratch, SEGMENTS_PER_ROUND * sizeof(size_t));
+    PieceJob job = {
+        .programs = program, .program_count = 1, .input = input, .starts = starts, .lens = lens,
+        .delimiter = delimiter, .terminated = true, .to_output = true,
+    };
+
+    size_t start = 0;
+    do {
+        job.count = 0;
+        while (job.count < SEGMENTS_PER_ROUND) {
+            const char* next = find_string(input + start, len - start, delimiter);
+            if (!next) {
+                break;
+            }
+            starts[job.count] = start;
+            lens[job.count++] = next - (input + start);
+            start = next - input + delimiter->count;
+        }
+        transform_pieces(&job, out, ctx);
+    } while (job.count == SEGMENTS_PER_ROUND);
+
+    if (eof && start < len) {
+        run_program_on(program, input + start, len - start, out, ctx);
+        start = len;
+    }
+    arena_reset(&ctx->scratch, mark);
+    return start;
+}
+
+// Runs each character of `input` through the window transformation for its position,
+// counting positions from `offset`, and appends the results to `out`.
+void run_windows(const ProgramList* commands, const char* input, size_t len, size_t offset, String* out, Context* ctx) {
+    PieceJob job = { .programs = commands->items, .program_count = commands->count, .offset = offset, .input = input, .count = len };
+    transform_pieces(&job, out, ctx);
+}
+
+// Appends `input` to `out` with the character at `charN` replaced by the result of running the '@' body on it.
+void run_at(const Node* node, const char* input, size_t len, size_t charN, String* out, Context* ctx) {
+    String_appendMany(out, input, charN);
+    run_program_on(&node->body, &input[charN], 1, out, ctx);
+    String_appendMany(out, input + charN + 1, len - charN - 1);
+}
+
+// Upper limit for the number of times a ':' runs its transformation, 0 for none.
+// Set with --max-iterations or EGG_MAX_ITERATIONS.
+size_t max_iterations = 100000;
+
+static bool same_string(const String* a, const String* b) {
+    return a->count == b->count && (a->count == 0 || memcmp(a->items, b->items, a->count) == 0);
+}
+
+// Runs `body` on `result` until that no longer changes it. Every result is written to the spare
+// buffer and swapped with the previous one, so once both are large enough no iteration copies or
+// allocates more than running the body does. Results that come back without ever settling, like
+// those of `:i`, are found with Brent's algorithm: the result is compared with a checkpoint that
+// is moved to the latest result after 1, 2, 4, 8, ... iterations, which meets a repeating result
+// within about twice the length of the cycle after it has started.
+void repeat_until_unchanged(const Program* body, String* result, Context* ctx) {
+    String* checkpoint = &ctx->checkpoint;
+    checkpoint->count = 0;
+    String_appendMany(checkpoint, result->items, result->count);
+    size_t since_checkpoint = 0;
+    size_t checkpoint_interval = 1;
+    for (size_t iteration = 1;; ++iteration) {
+        assert_msgf(max_iterations == 0 || iteration <= max_iterations,
+            "Transformation ':' did not settle within %zu iterations", max_iterations);
+        ctx->spare.count = 0;
+        run_program_on(body, result->items, result->count, &ctx->spare, ctx);
+        if (same_string(&ctx->spare, result)) {
+            return; // no change, stop repeating
+        }
+        swap_spare(result, ctx);
+        if (++since_checkpoint > 1) {
+            assert_msgf(!same_string(result, checkpoint),
+                "Transformation ':' never settles, its result repeats every %zu iterations", since_checkpoint);
+        }
+        if (since_checkpoint == checkpoint_interval) {
+            checkpoint->count = 0;
+            String_appendMany(checkpoint, result->items, result->count);
+            since_checkpoint = 0;
+            checkpoint_interval *= 2;
+        }
+    }
+}
+
+// Runs a single node on `result`, in place or through the spare buffer of `ctx`. See run_node.
+static inline void execute_node(const Node* node, String* result, Context* ctx) {
+    String* spare = &ctx->spare;
 
-        if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            char *result = find_file_path_fragment(full_path, needle, new_rel_path, found);
-            if (*found) {
-                FindClose(hFind);
-                return result;
+    switch (node->op) {
+        case 'u': tf_upper(result); break;
+        case 'l': tf_lower(result); break;
+        case 'r': tf_reverse(result); break;
+        case 'C': tf_capitalize(result); break;
+        case 'D': tf_decapitalize(result); break;
+        case 'd': tf_duplicate(result); break;
+        case 's': tf_strip(result); break;
+        case 't': tf_trim(result); break;
+        case 'j': tf_join(result); break;
+        case 'e': tf_escape(result, spare); swap_spare(result, ctx); break;
+        case 'n': tf_unescape(result, spare); swap_spare(result, ctx); break;
+        case '-': tf_drop(result); break;
+        case 'i': tf_invert_case(result); break;
+        
+        case 'b': tf_base64_encode(result, spare); swap_spare(result, ctx); break;
+        case 'B': tf_base64_decode(result, spare); swap_spare(result, ctx); break;
+        case 'v': tf_base64_encode_unpadded(result, spare); swap_spare(result, ctx); break;
+        case 'w': tf_base64url_encode(result, spare); swap_spare(result, ctx); break;
+        case 'W': tf_base64url_decode(result, spare); swap_spare(result, ctx); break;
+        case 'h': tf_hex_encode(result, spare); swap_spare(result, ctx); break;
+        case 'H': tf_hex_decode(result, spare); swap_spare(result, ctx); break;
+        case 'X': tf_hex_encode_upper(result, spare); swap_spare(result, ctx); break;
+        case '^': tf_xor_cipher(result, spare); swap_spare(result, ctx); break;
+        case 'c': tf_crc32(result, spare); swap_spare(result, ctx); break;
+        case 'k': tf_crc32c(result, spare); swap_spare(result, ctx); break;
+        case 'K': tf_xxh64(result, spare); swap_spare(result, ctx); break;
+        case '.': break;
+        case OP_BYTE_MAP: tf_byte_map(result, (const unsigned char*) node->str.items); break;
+        case '|': // Split at(string)
+            {
+                bool joined = false;
+                spare->count = 0;
+                split_segments(node, result->items, result->count, true, &joined, 0, spare, ctx);
+                swap_spare(result, ctx);
             }
-        } else {
-            if (strstr(new_rel_path, needle)) {
-                *found = true;
-                FindClose(hFind);
-                return duplicate_string(full_path);
+            break;
+        case 'a': // Append(string)
+            String_appendMany(result, node->str.items, node->str.count);
+            break;
+        case 'p': // Prepend(string)
+            spare->count = 0;
+            String_reserve(spare, node->str.count + result->count);
+            String_appendMany(spare, node->str.items, node->str.count);
+            String_appendMany(spare, result->items, result->count);
+            swap_spare(result, ctx);
+            break;
+        case 'x': // Remove(string)
+            spare->count = 0;
+            if (node->rules.count > 0) {
+                replace_rules(result->items, result->count, result->count, &node->rules, spare, ctx);
+            } else {
+                remove_string(result->items, result->count, result->count, &node->str, spare);
             }
-        }
-    } while (FindNextFileA(hFind, &ffd));
+            swap_spare(result, ctx);
+            break;
+        case 'E': // For Each Char
+            {
+                PieceJob job = { .programs = &node->body, .program_count = 1, .input = result->items, .count = result->count };
+                spare->count = 0;
+                transform_pieces(&job, spare, ctx);
+                swap_spare(result, ctx);
+            }
+            break;
+        case 'L': // limit length (e.g. l10)
+            if (result->count > node->number) {
+                result->count = node->number;
+            }
+            break;
+        case '@': // only for nth char (e.g. @3)
+            if (node->number >= result->count) {
+                break; // no change if charN is out of bounds
+            }
+            spare->count = 0;
+            run_at(node, result->items, result->count, node->number, spare, ctx);
+            swap_spare(result, ctx);
+            break;
+        case '\'':
+            run_program(&node->body, result, ctx);
+            break;
+        case '{': // match and replace
+            spare->count = 0;
+            String_reserve(spare, result->count);
+            replace_rules(result->items, result->count, result->count, &node->rules, spare, ctx);
+            swap_spare(result, ctx);
+            break;
+        case '[': // window of commands
+            if (node->windows.count == 0) {
+                break; // No commands, leave the result as is
+            }
+            spare->count = 0;
+            run_windows(&node->windows, result->items, result->count, 0, spare, ctx);
+            swap_spare(result, ctx);
+            break;
+        case ':': // repeat
+            repeat_until_unchanged(&node->body, result, ctx);
+            break;
 
-    FindClose(hFind);
-    return NULL;
+        default:
+            assert_msgf(false, "Unknown transformation: %c", node->op);
+    }
+}
+
+// --profile: how often each node ran, for how long, the bytes it got and gave, and the allocations made
+// while it ran. Nested nodes count towards the nodes they are part of, so a basket shows what its
+// nodes took together. When several threads run the nodes of an 'E', '[' or '|' their times add up.
+bool profiling = false;
+
+typedef struct NodeProfile {
+    size_t calls;
+    uint64_t nanoseconds;
+    size_t bytes_in;
+    size_t bytes_out;
+    size_t allocations;
+} NodeProfile;
+
+uint64_t monotonic_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t) (counter.QuadPart * (1e9 / frequency.QuadPart));
 #else
-    DIR *dir = opendir(base_path);
-    assert_msg(dir != NULL, "Could not open directory");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
 
-    struct dirent *dp;
-    while ((dp = readdir(dir)) != NULL && !*found) {
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-            continue;
+typedef struct {
+    uint64_t start;
+    size_t bytes_in;
+    size_t allocations;
+} ProfileMark;
 
-        char full_path[4096];
-        join_path(full_path, sizeof(full_path), base_path, dp->d_name);
+static inline ProfileMark profile_start(size_t bytes_in) {
+    return (ProfileMark) { .start = monotonic_ns(), .bytes_in = bytes_in, .allocations = thread_allocation_count };
+}
 
-        char new_rel_path[4096];
-        if (relative_path[0])
-            snprintf(new_rel_path, sizeof(new_rel_path), "%s/%s", relative_path, dp->d_name);
-        else
-            snprintf(new_rel_path, sizeof(new_rel_path), "%s", dp->d_name);
+static void profile_end(const Node* node, ProfileMark mark, size_t bytes_out) {
+    NodeProfile* profile = node->profile;
+    if (!profile) return; // compiled after attach_profiles
+    atomic_add(profile->nanoseconds, monotonic_ns() - mark.start);
+    atomic_add(profile->calls, 1);
+    atomic_add(profile->bytes_in, mark.bytes_in);
+    atomic_add(profile->bytes_out, bytes_out);
+    atomic_add(profile->allocations, thread_allocation_count - mark.allocations);
+}
 
-        struct stat st;
-        if (stat(full_path, &st) != 0) continue;
+// Gives every node of a program, and of the programs nested in it, a profile to fill in.
+void attach_profiles(const Program* program) {
+    for (size_t i = 0; i < program->count; ++i) {
+        Node* node = &program->items[i];
+        if (node->profile) continue; // a basket used before
+        node->profile = malloc_or_die(sizeof(NodeProfile));
+        *node->profile = (NodeProfile) {0};
+        attach_profiles(&node->body);
+        for (size_t k = 0; k < node->windows.count; ++k) {
+            attach_profiles(&node->windows.items[k]);
+        }
+    }
+}
 
-        if (S_ISDIR(st.st_mode)) {
-            char *result = find_file_path_fragment(full_path, needle, new_rel_path, found);
-            if (*found) {
-                closedir(dir);
-                return result;
-            }
-        } else if (S_ISREG(st.st_mode)) {
-            if (strstr(new_rel_path, needle)) {
-                *found = true;
-                closedir(dir);
-                return duplicate_string(full_path);
-            }
+// A short description of a node for the profile, e.g. `x'fox'` or `{3 rules}`.
+static void describe_node(const Node* node, char* out, size_t size) {
+    char argument[24] = "";
+    const String* str = &node->str;
+    if (node->op == '\'') {
+        // the name it was used by, without the directory and extension
+        const char* name = strrchr(str->items, '/') ? strrchr(str->items, '/') + 1 : str->items;
+        const char* extension = strstr(name, ".basket");
+        snprintf(out, size, "'%.*s'", (int) (extension ? (size_t) (extension - name) : strlen(name)), name);
+    } else if ((node->op == 'a' || node->op == 'p' || node->op == 'x' || node->op == '|') && node->rules.count == 0) {
+        size_t len = str->count;
+        size_t shown = len < 16 ? len : 16;
+        for (size_t k = 0; k < shown; ++k) {
+            argument[k] = str->items[k] >= ' ' && str->items[k] <= '~' ? str->items[k] : '.';
         }
+        argument[shown] = '\0';
+        snprintf(out, size, "%c'%s%s'", node->op, argument, len > shown ? "..." : "");
+    } else if (node->rules.count > 0) {
+        snprintf(out, size, "%s{%zu %s}", node->op == 'x' ? "x" : "", node->rules.count, node->op == 'x' ? "strings" : "rules");
+    } else if (node->op == 'L' || node->op == '@') {
+        snprintf(out, size, "%c%zu", node->op, node->number);
+    } else if (node->op == '[') {
+        snprintf(out, size, "[%zu]", node->windows.count);
+    } else if (node->op == OP_BYTE_MAP) {
+        snprintf(out, size, "byte map of %zu", node->number);
+    } else {
+        snprintf(out, size, "%c", node->op);
     }
+}
 
-    closedir(dir);
-    return NULL;
+void print_profile(const Program* program, int depth) {
+    for (size_t i = 0; i < program->count; ++i) {
+        const Node* node = &program->items[i];
+        const NodeProfile* profile = node->profile;
+        char label[40];
+        describe_node(node, label, sizeof(label));
+        fprintf(stderr, "%*s%-*s", depth * 2, "", 28 - depth * 2 > 1 ? 28 - depth * 2 : 1, label);
+        if (profile && profile->calls > 0) {
+            fprintf(stderr, " %10zu %12.3f %14zu %14zu %12zu\n", profile->calls, profile->nanoseconds / 1e6,
+                profile->bytes_in, profile->bytes_out, profile->allocations);
+        } else {
+            fprintf(stderr, " %10s\n", profile ? "0" : "-");
+        }
+        if (node->op != OP_BYTE_MAP) { // its body is not run
+            print_profile(&node->body, depth + 1);
+        }
+        for (size_t k = 0; k < node->windows.count; ++k) {
+            print_profile(&node->windows.items[k], depth + 1);
+        }
+    }
+}
+
+// Kept out of run_node, so that without --profile running a node costs a single test more.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((noinline, cold))
 #endif
+static void run_node_profiled(const Node* node, String* result, Context* ctx) {
+    ProfileMark mark = profile_start(result->count);
+    execute_node(node, result, ctx);
+    profile_end(node, mark, result->count);
 }
 
-char *find_in_multiple_dirs(const char **dirs, size_t dir_count, const char *needle) {
-    for (size_t i = 0; i < dir_count; ++i) {
-        bool found = false;
-        char *match = find_file_path_fragment(dirs[i], needle, "", &found);
-        if (found)
-            return match;
+void run_node(const Node* node, String* result, Context* ctx) {
+    if (profiling) {
+        run_node_profiled(node, result, ctx);
+        return;
     }
-    return NULL; // Not found in any directory
+    execute_node(node, result, ctx);
 }
 
-String read_transformation(const char* transformation, size_t* i) {
-    assert(i && transformation);
-    #define i (*i)
-    String trans = {0};
-    while (isSpace(transformation[i])) i++;
-    switch (transformation[i]) {
-        case '{': {
-                int brace_depth = 0;
-                String_appendChar(&trans, '{');
-                i++;
-                while ((transformation[i] != '}' || brace_depth > 0) && transformation[i] != 0) {
-                    if (transformation[i] == '{') {
-                        brace_depth++;
-                    } else if (transformation[i] == '}') {
-                        brace_depth--;
-                    }
-                    String_appendChar(&trans, transformation[i]);
-                    i++;
-                }
-                if (transformation[i] == '}') {
-                    String_appendChar(&trans, '}');
-                } else {
-                    fprintf(stderr, "Error: Unmatched '{' in transformation.\n");
+// Runs a compiled transformation on `str`, replacing its contents with the result.
+void run_program(const Program* program, String* str, Context* ctx) {
+    assert_msg(program && str && ctx, "Program, string and context must not be NULL");
+
+    for (size_t i = 0; i < program->count; ++i) {
+        run_node(&program->items[i], str, ctx);
+    }
+}
+
+#define STREAM_CHUNK_SIZE 65536
+
+// Standard input, or the file given with -i.
+int input_fd = STDIN_FILENO;
+
+// The input, when it is a regular file that could be mapped into memory.
+typedef struct {
+    char* data;
+    size_t size;
+    size_t offset;   // next byte for read_input
+    size_t released; // the pages before this were given back, see release_input
+} MappedInput;
+
+MappedInput mapped_input = {0};
+
+// Input pages are given back in steps of this size, a multiple of any page size.
+#define INPUT_RELEASE_SIZE (1 << 21)
+
+// Maps the input if it is a regular file.
+void map_input(void) {
+#ifndef _WIN32
+    struct stat info;
+    if (fstat(input_fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0) {
+        return;
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0);
+    if (data == MAP_FAILED) {
+        return; // read it instead
+    }
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(data, info.st_size, MADV_HUGEPAGE);
+#endif
+    mapped_input = (MappedInput) { .data = data, .size = info.st_size };
+#endif
+}
+
+void unmap_input(void) {
+#ifndef _WIN32
+    if (mapped_input.data) {
+        munmap(mapped_input.data, mapped_input.size);
+        mapped_input = (MappedInput) {0};
+    }
+#endif
+}
+
+// Gives back the pages of the mapped input before `end`, which were used up, so that
+// the mapping does not stay resident next to the copies the transformation makes.
+void release_input(size_t end) {
+#ifndef _WIN32
+    size_t until = end - end % INPUT_RELEASE_SIZE;
+    if (until > mapped_input.released) {
+        madvise(mapped_input.data + mapped_input.released, until - mapped_input.released, MADV_DONTNEED);
+        mapped_input.released = until;
+    }
+#else
+    (void) end;
+#endif
+}
+
+// Reads the next at most `size` bytes of input into `buffer`. Returns 0 at the end of the input.
+size_t read_input(char* buffer, size_t size) {
+    if (mapped_input.data) {
+        size_t left = mapped_input.size - mapped_input.offset;
+        if (size > left) size = left;
+        memcpy(buffer, mapped_input.data + mapped_input.offset, size);
+        mapped_input.offset += size;
+        release_input(mapped_input.offset);
+        return size;
+    }
+    int read_size = read(input_fd, buffer, size);
+    assert_msg(read_size >= 0, "Could not read the input");
+    return read_size;
+}
+
+// Copies all of the input to standard output inside the kernel, which works when either of them is a pipe.
+// Returns false, without having consumed anything, if that is not possible.
+bool splice_input(void) {
+#ifdef __linux__
+    bool started = false;
+    while (true) {
+        ssize_t moved = splice(input_fd, NULL, STDOUT_FILENO, NULL, OUTPUT_BLOCK_MAX, SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved < 0 && !started) return false;
+        assert_msg(moved >= 0, "Could not write the output");
+        if (moved == 0) return true;
+        started = true;
+    }
+#else
+    return false;
+#endif
+}
+
+// Whether a node can transform its input piece by piece, carrying over at most
+// a partial match between pieces. The others need to see the whole input at once.
+bool is_streamable(const Node* node) {
+    switch (node->op) {
+        case 'r':
+        case 'd':
+        case 't':
+        case ':':
+            return false;
+        case '\'':
+            for (size_t i = 0; i < node->body.count; ++i) {
+                if (!is_streamable(&node->body.items[i])) return false;
+            }
+            return true;
+        default:
+            return true;
+    }
+}
+
+// Baskets are plain sequences of nodes, so they can be spliced into the stream pipeline.
+void flatten_program(const Program* program, Program* flat) {
+    for (size_t i = 0; i < program->count; ++i) {
+        if (program->items[i].op == '\'') {
+            flatten_program(&program->items[i].body, flat);
+        } else {
+            List_append(flat, program->items[i]);
+        }
+    }
+}
+
+typedef struct {
+    const Node* node;
+    Context ctx;
+    String carry;     // input held back until more of it (or the end of input) arrives
+    size_t position;  // number of input bytes this stage has consumed so far
+    size_t searched;  // '|': bytes at the start of the carry already looked through for the delimiter
+    bool started;     // 'p', '|': something was written already, 'B', 'W': the padding was seen, 'K': xxh is set up
+    bool mid_word;    // 'C', 'D': the previous piece ended inside a word
+    unsigned int crc; // 'c', 'k': checksum of the input so far
+    Xxh64 xxh;        // 'K': hash state of the input so far
+} StreamStage;
+
+// Moves everything from `from` on into the stage's carry-over and cuts it off the input.
+void hold_back(StreamStage* stage, String* input, size_t from) {
+    String_appendMany(&stage->carry, input->items + from, input->count - from);
+    input->count = from;
+}
+
+// Applies the rules of a '{' or 'x{' node, leaving what could be the start of a match unconsumed unless `eof` is set.
+size_t stream_rules(const Node* node, const char* input, size_t len, bool eof, String* out, Context* ctx) {
+    size_t longest = node->rules.matcher.longest;
+    size_t keep = longest > 1 ? longest - 1 : 0;
+    return replace_rules(input, len, eof ? len : (len > keep ? len - keep : 0), &node->rules, out, ctx);
+}
+
+// Streams a '|' node with a delimiter. The text since the last delimiter can get arbitrarily long,
+// so it stays in the carry with new input appended to it, and only the new bytes are searched.
+static void step_split(StreamStage* stage, String* input, bool eof) {
+    const Node* node = stage->node;
+    String* carry = &stage->carry;
+    if (input->count > 0) {
+        String_appendMany(carry, input->items, input->count);
+    }
+    input->count = 0;
+
+    size_t overlap = node->str.count - 1;
+    size_t from = stage->searched > overlap ? stage->searched - overlap : 0;
+    if (!eof && !find_string(carry->items + from, carry->count - from, &node->str)) {
+        stage->searched = carry->count;
+        return;
+    }
+    String* spare = &stage->ctx.spare;
+    spare->count = 0;
+    size_t consumed = split_segments(node, carry->items, carry->count, eof, &stage->started, from, spare, &stage->ctx);
+    stage->position += consumed;
+    if (consumed > 0) {
+        memmove(carry->items, carry->items + consumed, carry->count - consumed);
+        carry->count -= consumed;
+    }
+    stage->searched = carry->count; // what is left follows the last delimiter
+    swap_spare(input, &stage->ctx);
+}
+
+// Transforms the next piece of input in place for one stage of a streamed pipeline.
+static void step_stage(StreamStage* stage, String* input, bool eof) {
+    const Node* node = stage->node;
+    String* spare = &stage->ctx.spare;
+
+    if (node->op == '|' && node->str.count > 0) {
+        step_split(stage, input, eof);
+        return;
+    }
+    if (stage->carry.count > 0) {
+        String_appendMany(&stage->carry, input->items, input->count);
+        String temp = *input;
+        *input = stage->carry;
+        stage->carry = temp;
+        stage->carry.count = 0;
+    }
+
+    size_t len = input->count;
+    size_t consumed = len;
+    bool in_place = true; // otherwise the output was written to the spare buffer
+    spare->count = 0;
+
+    switch (node->op) {
+        case 'C':
+        case 'D':
+            if (len > 0) {
+                char first = input->items[0];
+                execute_node(node, input, &stage->ctx);
+                if (stage->mid_word && !isSpace(first)) {
+                    input->items[0] = first; // not actually the start of a word
                 }
+                stage->mid_word = !isSpace(input->items[len - 1]);
             }
             break;
-        case '[': {
-                int bracket_depth = 0;
-                String_appendChar(&trans, '[');
-                i++;
-                while ((transformation[i] != ']' || bracket_depth > 0) && transformation[i] != 0) {
-                    if (transformation[i] == '[') {
-                        bracket_depth++;
-                    } else if (transformation[i] == ']') {
-                        bracket_depth--;
-                    }
-                    String_appendChar(&trans, transformation[i]);
-                    i++;
-                }
-                if (transformation[i] == ']') {
-                    String_appendChar(&trans, ']');
-                } else {
-                    fprintf(stderr, "Error: Unmatched '[' in transformation.\n");
-                }
+        case 'n':
+            in_place = false;
+            consumed = unescape_chars(input->items, len, eof ? len : (len > 3 ? len - 3 : 0), spare);
+            break;
+        case '-':
+            if (!eof && len > 0) {
+                hold_back(stage, input, len - 1);
+            } else {
+                execute_node(node, input, &stage->ctx);
             }
             break;
-        case '(': {
-                int paren_depth = 0;
-                i++;
-                while ((transformation[i] != ')' || paren_depth > 0) && transformation[i] != 0) {
-                    if (transformation[i] == '(') {
-                        paren_depth++;
-                    } else if (transformation[i] == ')') {
-                        paren_depth--;
-                    }
-                    String_appendChar(&trans, transformation[i]);
-                    i++;
-                }
-                if (transformation[i] != ')') {
-                    fprintf(stderr, "Error: Unmatched '(' in transformation.\n");
-                }
+        case 'b':
+        case 'v':
+        case 'w':
+            in_place = false;
+            consumed = eof ? len : len - len % 3;
+            base64_encode(input->items, consumed, node->op == 'w' ? &base64_url : &base64_standard, node->op == 'b', spare);
+            break;
+        case 'H':
+            in_place = false;
+            consumed = hex_decode(input->items, len, eof, spare);
+            break;
+        case 'B':
+        case 'W':
+            in_place = false;
+            consumed = base64_decode(input->items, len, node->op == 'W' ? &base64_url : &base64_standard, eof, &stage->started, spare);
+            break;
+        case 'c':
+        case 'k':
+            stage->crc = (node->op == 'c' ? crc32 : crc32c)(stage->crc, (unsigned char*) input->items, len);
+            input->count = 0;
+            if (eof) {
+                checksum_to_hex(stage->crc, 8, input);
             }
             break;
-        default: {
-                if (transformation[i] == '\\') {
-                    String_appendChar(&trans, transformation[i]);
-                    i++;
-                }
-                String_appendChar(&trans, transformation[i]);
+        case 'K':
+            if (!stage->started) {
+                xxh64_init(&stage->xxh);
+                stage->started = true;
+            }
+            xxh64_update(&stage->xxh, (unsigned char*) input->items, len);
+            input->count = 0;
+            if (eof) {
+                checksum_to_hex(xxh64_digest(&stage->xxh), 16, input);
+            }
+            break;
+        case '|':
+            in_place = false;
+            consumed = split_segments(node, input->items, len, eof, &stage->started, 0, spare, &stage->ctx);
+            break;
+        case 'a':
+            if (eof) {
+                execute_node(node, input, &stage->ctx);
+            }
+            break;
+        case 'p':
+            if (!stage->started) {
+                execute_node(node, input, &stage->ctx);
+            }
+            stage->started = true;
+            break;
+        case 'x':
+            in_place = false;
+            if (node->rules.count > 0) {
+                consumed = stream_rules(node, input->items, len, eof, spare, &stage->ctx);
+            } else {
+                size_t keep = node->str.count > 1 ? node->str.count - 1 : 0;
+                consumed = remove_string(input->items, len, eof ? len : (len > keep ? len - keep : 0), &node->str, spare);
+            }
+            break;
+        case 'L':
+            if (stage->position >= node->number) {
+                input->count = 0;
+            } else if (len > node->number - stage->position) {
+                input->count = node->number - stage->position;
+            }
+            break;
+        case '@':
+            if (node->number >= stage->position && node->number < stage->position + len) {
+                run_at(node, input->items, len, node->number - stage->position, spare, &stage->ctx);
+                swap_spare(input, &stage->ctx);
+            }
+            break;
+        case '{':
+            in_place = false;
+            consumed = stream_rules(node, input->items, len, eof, spare, &stage->ctx);
+            break;
+        case '[':
+            if (node->windows.count > 0) {
+                run_windows(&node->windows, input->items, len, stage->position, spare, &stage->ctx);
+                swap_spare(input, &stage->ctx);
             }
             break;
+        default:
+            execute_node(node, input, &stage->ctx);
+            break;
+    }
+    stage->position += consumed;
+
+    if (!in_place) {
+        if (consumed < len) {
+            hold_back(stage, input, consumed);
+        }
+        swap_spare(input, &stage->ctx);
+    }
+}
+
+// Transforms the next piece of input of a stage. Under --profile every piece counts as a call of its node.
+void stream_stage(StreamStage* stage, String* input, bool eof) {
+    if (!profiling) {
+        step_stage(stage, input, eof);
+        return;
+    }
+    ProfileMark mark = profile_start(input->count);
+    step_stage(stage, input, eof);
+    profile_end(stage->node, mark, input->count);
+}
+
+// Reads standard input in pieces and writes the transformed pieces as soon as they are ready.
+// The nodes up to the first one that needs the whole input are streamed, the rest of
+// the program runs on their buffered output once standard input is exhausted.
+void run_program_streaming(const Program* program) {
+    Program flat = {0};
+    flatten_program(program, &flat);
+
+    bool identity = true;
+    for (size_t i = 0; i < flat.count; ++i) {
+        identity = identity && flat.items[i].op == '.';
+    }
+    if (identity && splice_input()) {
+        if (flat.items) {
+            free_or_die(&flat.items);
+        }
+        return;
+    }
+
+    size_t stage_count = 0;
+    while (stage_count < flat.count && is_streamable(&flat.items[stage_count])) {
+        stage_count++;
+    }
+    StreamStage* stages = NULL;
+    if (stage_count > 0) {
+        stages = malloc_or_die(stage_count * sizeof(StreamStage));
+        for (size_t i = 0; i < stage_count; ++i) {
+            stages[i] = (StreamStage) { .node = &flat.items[i] };
+        }
+    }
+    Program rest = {
+        .items = flat.items + stage_count,
+        .count = flat.count - stage_count,
+    };
+
+    String chunk = {0};
+    String buffered = {0};
+    bool eof = false;
+    if (mapped_input.data && rest.count > 0) {
+        // a buffer of its own, rather than the mapping, which it could only grow by copying
+        String_reserve(&buffered, mapped_input.size);
+    }
+    while (!eof) {
+        // the stages swap buffers with their spare ones, so this is not always the same buffer
+        String_reserve(&chunk, STREAM_CHUNK_SIZE);
+        chunk.count = read_input(chunk.items, STREAM_CHUNK_SIZE);
+        eof = chunk.count == 0;
+
+        for (size_t i = 0; i < stage_count; ++i) {
+            stream_stage(&stages[i], &chunk, eof);
+        }
+
+        if (rest.count > 0) {
+            String_appendMany(&buffered, chunk.items, chunk.count);
+        } else if (chunk.count > 0) {
+            write_output(chunk.items, chunk.count);
+        }
+    }
+
+    if (rest.count > 0) {
+        unmap_input(); // all of it is in the buffer now
+        Context ctx = {0};
+        run_program(&rest, &buffered, &ctx);
+        if (buffered.count > 0) {
+            write_output(buffered.items, buffered.count);
+        }
+        free_context(&ctx);
+    }
+
+    free_string(&chunk);
+    free_string(&buffered);
+    for (size_t i = 0; i < stage_count; ++i) {
+        free_string(&stages[i].carry);
+        free_context(&stages[i].ctx);
+    }
+    if (stages) {
+        free_or_die(&stages);
+    }
+    if (flat.items) {
+        free_or_die(&flat.items);
+    }
+}
+
+#define RECORD_READ_SIZE (1 << 20)
+
+// Runs `program` on every record of standard input separately, as given by --lines and --records.
+// Complete records are transformed as soon as they are read, on the thread pool when a read
+// brings in many of them, and their results are written in input order.
+void run_records(const Program* program, const String* delimiter) {
+    Context ctx = {0};
+    String pending = {0}; // input that was read but not transformed yet
+    String out = {0};
+    size_t searched = 0;  // pending has no delimiter starting before this
+    bool eof = false;
+
+    // A mapped input is transformed right from the mapping, a window at a time.
+    // The window grows while a single record does not fit into it.
+    size_t window = RECORD_READ_SIZE;
+    while (mapped_input.data && !eof) {
+        size_t start = mapped_input.offset;
+        size_t len = mapped_input.size - start > window ? window : mapped_input.size - start;
+        eof = start + len == mapped_input.size;
+        out.count = 0;
+        size_t consumed = transform_records(program, delimiter, mapped_input.data + start, len, eof, &out, &ctx);
+        if (out.count > 0) {
+            write_output(out.items, out.count);
+        }
+        mapped_input.offset += consumed;
+        release_input(mapped_input.offset);
+        window = consumed > 0 ? RECORD_READ_SIZE : window * 2;
+    }
+
+    while (!eof) {
+        String_reserve(&pending, pending.count + RECORD_READ_SIZE);
+        size_t read_size = read_input(pending.items + pending.count, RECORD_READ_SIZE);
+        pending.count += read_size;
+        eof = read_size == 0;
+
+        // don't go over a long unfinished record again for every read
+        if (!eof && !find_string(pending.items + searched, pending.count - searched, delimiter)) {
+            searched = pending.count >= delimiter->count ? pending.count - delimiter->count + 1 : 0;
+            continue;
+        }
+
+        out.count = 0;
+        size_t consumed = transform_records(program, delimiter, pending.items, pending.count, eof, &out, &ctx);
+        if (out.count > 0) {
+            write_output(out.items, out.count);
+        }
+        memmove(pending.items, pending.items + consumed, pending.count - consumed);
+        pending.count -= consumed;
+        searched = 0;
     }
-    String_appendTerminator(&trans);
-    #undef i
-    return trans;
+
+    free_string(&pending);
+    free_string(&out);
+    free_context(&ctx);
 }
 
-char read_char(const char* transformation, size_t* i) {
-    assert(i && transformation);
-    #define i (*i)
-    if (transformation[i] == '\\') {
-        i++;
-        switch (transformation[i]) {
-            case 'x': {
-                // hex
-                i++;
-                char hex[3] = {0};
-                hex[0] = transformation[i++];
-                hex[1] = transformation[i];
-                int value = (int)strtol(hex, NULL, 16);
-                return (char)value;
-            } break;
-            default:
-                return unescaped_chars[(int) transformation[i]];
-                break;
-        }
+// Compiling touches the basket cache and index and the checksum tables, so it is done by one thread at a time.
+#ifndef _WIN32
+pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef EGG_LIBRARY
+struct egg_program {
+    Program program;
+};
+
+static egg_status library_error(egg_status status, const char* message) {
+    snprintf(error_message, sizeof(error_message), "%s", message);
+    return status;
+}
+
+// What egg_compile and egg_run clean up after an error, kept off the stack so it survives the longjmp.
+typedef struct {
+    Arena scratch;
+    String result;
+    Context ctx;
+} LibraryCall;
+
+EGG_API egg_status egg_compile(const char* transformation, egg_program** program) {
+    if (!transformation || !program) {
+        return library_error(EGG_ERROR_ARGUMENT, "egg_compile: transformation and program must not be NULL");
+    }
+    *program = NULL;
+    LibraryCall* call = calloc(1, sizeof(LibraryCall));
+    egg_program* compiled = calloc(1, sizeof(egg_program));
+    if (!call || !compiled) {
+        free(call);
+        free(compiled);
+        return library_error(EGG_ERROR_MEMORY, "Memory allocation failed");
+    }
+
+#ifndef _WIN32
+    pthread_mutex_lock(&compile_lock);
+#endif
+    egg_status status = EGG_OK;
+    jmp_buf jump;
+    allocation_failed = false;
+    if (setjmp(jump) == 0) {
+        error_jump = &jump;
+        compiled->program = compile_transformation(transformation, 0, &call->scratch);
     } else {
-        return transformation[i];
+        status = allocation_failed ? EGG_ERROR_MEMORY : EGG_ERROR_COMPILE;
+        free_unfinished_programs();
     }
-    #undef i
+    error_jump = NULL;
+#ifndef _WIN32
+    pthread_mutex_unlock(&compile_lock);
+#endif
+
+    arena_free(&call->scratch);
+    free(call);
+    if (status == EGG_OK) {
+        *program = compiled;
+    } else {
+        free(compiled);
+    }
+    return status;
 }
 
-String read_string(const char* transformation, size_t* i) {
-    assert(i && transformation);
-    #define i (*i)
-    String str = {0};
-    if (transformation[i] == '\'') {
-        i++;
-        while (transformation[i] != '\'' && transformation[i] != 0) {
-            String_appendChar(&str, read_char(transformation, &i));
-            i++;
+EGG_API egg_status egg_run(const egg_program* program, const char* input, size_t len, egg_buffer* out) {
+    if (!program || !out || (!input && len > 0)) {
+        return library_error(EGG_ERROR_ARGUMENT, "egg_run: program, input and out must not be NULL");
+    }
+    LibraryCall* call = calloc(1, sizeof(LibraryCall));
+    if (!call) {
+        return library_error(EGG_ERROR_MEMORY, "Memory allocation failed");
+    }
+    // the buffer belongs to the call until it is done, so it is freed if the call fails
+    call->result = (String) { .items = out->data, .capacity = out->data ? out->capacity : 0 };
+    *out = (egg_buffer) {0};
+
+    egg_status status = EGG_OK;
+    jmp_buf jump;
+    allocation_failed = false;
+    if (setjmp(jump) == 0) {
+        error_jump = &jump;
+        if (len > 0) {
+            String_appendMany(&call->result, input, len);
         }
+        run_program(&program->program, &call->result, &call->ctx);
+        *out = (egg_buffer) { .data = call->result.items, .len = call->result.count, .capacity = call->result.capacity };
+        call->result = (String) {0};
     } else {
-        // just one char
-        String_appendChar(&str, read_char(transformation, &i));
+        status = allocation_failed ? EGG_ERROR_MEMORY : EGG_ERROR_RUN;
     }
-    String_appendTerminator(&str);
-    #undef i
-    return str;
+    error_jump = NULL;
+
+    free_string(&call->result);
+    free_context(&call->ctx);
+    free(call);
+    return status;
 }
 
-int sort_match_replace(const void* va, const void* vb) {
-    const char* a = *(const char**) va;
-    const char* b = *(const char**) vb;
-    // Sort by length first, then lexicographically
-    size_t len_a = strlen(a);
-    size_t len_b = strlen(b);
-    if (len_a != len_b) {
-        return len_b - len_a;
+EGG_API void egg_free_program(egg_program* program) {
+    if (program) {
+        free_program(&program->program);
+        free(program);
     }
-    return -strcmp(a, b);
 }
 
-char* run_transformation(const char* transformation, const char* input) {
-    assert_msg(input && transformation, "Input and transformation must not be NULL");
-    if (strlen(transformation) == 0) {
-        return duplicate_string(input);
+EGG_API void egg_free_buffer(egg_buffer* buffer) {
+    if (buffer) {
+        free(buffer->data);
+        *buffer = (egg_buffer) {0};
     }
-    
-    char* result = duplicate_string(input);
-    free_or_die(&input);
-    for (size_t i = 0; transformation[i]; ++i) {
-        char op = transformation[i];
-        
-        #define checkIncrement() do { assert_msgf(transformation[i + 1], "Transformation '%s' is incomplete at position %zu: Got 0x%02x (%c)", transformation, i, transformation[i + 1]); i++; } while (0)
+}
 
-        switch (op) {
-            case ' ':
-            case '(':
-            case ')':
-            case '\t':
-            case '\n':
-            case '\r':
-            case '\0': break;
-            case 'u': free_and_replace(&result, tf_upper(result)); break;
-            case 'l': free_and_replace(&result, tf_lower(result)); break;
-            case 'r': free_and_replace(&result, tf_reverse(result)); break;
-            case 'C': free_and_replace(&result, tf_capitalize(result)); break;
-            case 'D': free_and_replace(&result, tf_decapitalize(result)); break;
-            case 'd': free_and_replace(&result, tf_duplicate(result)); break;
-            case 's': free_and_replace(&result, tf_strip(result)); break;
-            case 't': free_and_replace(&result, tf_trim(result)); break;
-            case 'j': free_and_replace(&result, tf_join(result)); break;
-            case 'e': free_and_replace(&result, tf_escape(result)); break;
-            case 'n': free_and_replace(&result, tf_unescape(result)); break;
-            case '-': free_and_replace(&result, tf_drop(result)); break;
-            case 'i': free_and_replace(&result, tf_invert_case(result)); break;
-            
-            case 'b': free_and_replace(&result, tf_base64_encode(result)); break;
-            case 'B': free_and_replace(&result, tf_base64_decode(result)); break;
-            case 'h': free_and_replace(&result, tf_hex_encode(result)); break;
-            case 'H': free_and_replace(&result, tf_hex_decode(result)); break;
-            case '^': free_and_replace(&result, tf_xor_cipher(result)); break;
-            case 'c': free_and_replace(&result, tf_crc32(result)); break;
-            case '.': free_and_replace(&result, duplicate_string(result)); break;
-            case '|': // Split at(string)
-                {
-                    checkIncrement();
-                    String splitStr = read_string(transformation, &i);
+EGG_API const char* egg_error_message(void) {
+    return error_text();
+}
+#else
+// --batch and --serve answer requests one after another, from standard input or from each connection
+// to a Unix socket, so that a caller with many strings to transform does not start egg for each one.
+// A request is two netstrings, the transformation and its input: `1:u,5:hello,`. The answer is the
+// output as a netstring, `5:HELLO,`, or `!` and the error message as a netstring if the
+// transformation could not be compiled or run. Transformations are compiled once and kept, together
+// with the baskets they use, for all later requests.
+#define SERVED_PROGRAMS_MAX 1024
+#define REQUEST_READ_SIZE 65536
+#define ANSWER_BUFFER_SIZE 65536
 
-                    checkIncrement();
-                    String transformExpr = read_transformation(transformation, &i);
-
-                    // Step 1: Split the result
-                    StringList segments = {0};
-
-                    if (splitStr.items[0] == '\0') {
-                        // Special case: split into individual characters
-                        for (size_t k = 0; result[k]; ++k) {
-                            String part = {0};
-                            char *char_str = malloc_or_die(2);
-                            char_str[0] = result[k];
-                            char_str[1] = '\0';
-                            String_appendCStr(&part, char_str);
-                            String_appendTerminator(&part);
-                            StringList_append(&segments, part);
-                            free_or_die(&char_str);
-                        }
-                    } else {
-                        char *start = result;
-                        char *next = strstr(start, splitStr.items);
-
-                        while (next) {
-                            size_t len = next - start;
-                            if (len > 0) {
-                                String part = {0};
-                                char *buffer = malloc_or_die(len + 1);
-                                strncpy(buffer, start, len);
-                                buffer[len] = '\0';
-                                String_appendCStr(&part, buffer);
-                                String_appendTerminator(&part);
-                                StringList_append(&segments, part);
-                                free_or_die(&buffer);
-                            }
-                            start = next + splitStr.count - 1;
-                            next = strstr(start, splitStr.items);
-                        }
-
-                        if (*start) {
-                            String tail = {0};
-                            String_appendCStr(&tail, start);
-                            String_appendTerminator(&tail);
-                            StringList_append(&segments, tail);
-                        }
-                    }
+typedef struct {
+    char* transformation;
+    uint64_t hash;
+    Program program;
+    char* error; // why it did not compile, or NULL
+} ServedProgram;
 
-                    // Step 2: Transform each segment
-                    StringList transformedSegments = {0};
-                    for (size_t j = 0; j < segments.count; ++j) {
-                        char *transformed = run_transformation(transformExpr.items, segments.items[j].items);
+typedef struct {
+    ServedProgram* items;
+    size_t count;
+    size_t capacity;
+} ServedPrograms;
 
-                        String str = {0};
-                        String_appendCStr(&str, transformed);
-                        String_appendTerminator(&str);
-                        StringList_append(&transformedSegments, str);
+ServedPrograms served_programs = {0};
 
-                        free_or_die(&transformed);
-                    }
+// The state of answering a stream of requests. It is kept off the stack, so that it survives
+// a longjmp out of a failed request.
+typedef struct {
+    int in;
+    int out;
+    String requests;   // received, the ones before `start` are answered
+    size_t start;
+    String answers;    // answers not written yet
+    String result;
+    Context ctx;
+    char error[sizeof(error_message)];
+} Connection;
 
-                    // Step 3: Rejoin transformed segments
-                    String finalResult = {0};
-                    for (size_t j = 0; j < transformedSegments.count; ++j) {
-                        String_appendCStr(&finalResult, transformedSegments.items[j].items);
-                        if (j < transformedSegments.count - 1) {
-                            String_appendCStr(&finalResult, splitStr.items);  // safe even if empty
-                        }
-                    }
-                    String_appendTerminator(&finalResult);
+void free_connection(Connection* c) {
+    free_string(&c->requests);
+    free_string(&c->answers);
+    free_string(&c->result);
+    free_context(&c->ctx);
+    free(c);
+}
 
-                    // Cleanup
-                    StringList_free(segments);
-                    for (size_t j = 0; j < transformedSegments.count; ++j) {
-                        String_free(transformedSegments.items[j]);
-                    }
-                    StringList_free(transformedSegments);
+void free_served_programs(void) {
+    for (size_t k = 0; k < served_programs.count; ++k) {
+        free_or_die(&served_programs.items[k].transformation);
+        free_program(&served_programs.items[k].program);
+        if (served_programs.items[k].error) {
+            free_or_die(&served_programs.items[k].error);
+        }
+    }
+    if (served_programs.items) {
+        free_or_die(&served_programs.items);
+    }
+    served_programs = (ServedPrograms) {0};
+}
 
-                    String_free(splitStr);
-                    String_free(transformExpr);
+// Compiles a transformation, or copies why it does not compile to `error` and returns false.
+static bool compile_caught(const char* transformation, Program* program, Arena* scratch, char* error) {
+    jmp_buf* outer = error_jump;
+    jmp_buf jump;
+    if (setjmp(jump) == 0) {
+        error_jump = &jump;
+        *program = compile_transformation(transformation, 0, scratch);
+        error_jump = outer;
+        return true;
+    }
+    error_jump = outer;
+    free_unfinished_programs();
+    *program = (Program) {0};
+    snprintf(error, sizeof(error_message), "%s", error_text());
+    return false;
+}
 
-                    free_and_replace(&result, finalResult.items);
-                }
+// Gets the compiled program of a transformation, compiling it the first time. Returns false, with
+// the message in `error`, if it does not compile. Once SERVED_PROGRAMS_MAX transformations are kept
+// new ones are compiled for every request, so the program is released with free_program after use;
+// for kept ones that does nothing, as they are shared.
+bool served_program(const char* transformation, size_t len, Program* program, char* error) {
+    uint64_t hash = fnv1a(transformation, len);
+    // running out of memory while holding the lock ends the server instead of leaving it locked
+    jmp_buf* outer = error_jump;
+    error_jump = NULL;
+#ifndef _WIN32
+    pthread_mutex_lock(&compile_lock);
+#endif
+    ServedProgram* found = NULL;
+    for (size_t k = 0; k < served_programs.count && !found; ++k) {
+        ServedProgram* served = &served_programs.items[k];
+        if (served->hash == hash && strlen(served->transformation) == len && memcmp(served->transformation, transformation, len) == 0) {
+            found = served;
+        }
+    }
 
-                break;
-            case 'a': // Append(string)
-                {
-                    String str = {0};
-                    String_appendCStr(&str, result);
-                    checkIncrement();
-                    while (isSpace(transformation[i])) checkIncrement();
-                    String append_str = read_string(transformation, &i);
-                    String_appendCStr(&str, append_str.items);
-                    String_free(append_str);
+    bool ok;
+    if (found) {
+        ok = !found->error;
+        *program = found->program;
+        if (found->error) {
+            snprintf(error, sizeof(error_message), "%s", found->error);
+        }
+    } else {
+        ServedProgram served = { .hash = hash, .transformation = malloc_or_die(len + 1) };
+        memcpy(served.transformation, transformation, len);
+        served.transformation[len] = '\0';
+        Arena scratch = {0};
+        ok = compile_caught(served.transformation, &served.program, &scratch, error);
+        arena_free(&scratch);
+        *program = served.program;
+        if (served_programs.count < SERVED_PROGRAMS_MAX) {
+            served.error = ok ? NULL : duplicate_string(error);
+            List_append(&served_programs, served);
+            found = &served_programs.items[served_programs.count - 1];
+        } else {
+            free_or_die(&served.transformation);
+        }
+    }
+    program->shared = found != NULL;
+#ifndef _WIN32
+    pthread_mutex_unlock(&compile_lock);
+#endif
+    error_jump = outer;
+    return ok;
+}
 
-                    String_appendTerminator(&str);
-                    free_and_replace(&result, str.items);
-                }
-                break;
-            case 'p': // Prepend(string)
-                {
-                    checkIncrement();
-                    while (isSpace(transformation[i])) checkIncrement();
-                    String str = read_string(transformation, &i);
-                    str.count--; // remove the null terminator
-                    String_appendCStr(&str, result);
-                    String_appendTerminator(&str);
-                    free_and_replace(&result, str.items);
-                }
-                break;
-            case 'x': // Remove(string)
-                {
-                    checkIncrement();
-                    while (isSpace(transformation[i])) checkIncrement();
-                    String str = read_string(transformation, &i);   
-                    
-                    size_t result_len = strlen(result);
-                    String new_result = {0};
-
-                    for (size_t j = 0; j < result_len; ++j) {
-                        bool found = str.count != 1 && strstr(&result[j], str.items) == &result[j];
-                        if (!found) {
-                            String_appendChar(&new_result, result[j]);
-                        } else {
-                            // skip the length of the string to remove
-                            j += str.count - 2; // -1 because we will increment j in the loop
-                        }
-                    }
-                    String_appendTerminator(&new_result);
-                    String_free(str);
-                    free_and_replace(&result, new_result.items);
-                }
-                break;
-            case 'E': // For Each Char
-                {
-                    checkIncrement();
-                    String trans = read_transformation(transformation, &i);
-                    
-                    String str = {0};
-                    for (size_t j = 0; result[j]; ++j) {
-                        char* temp = malloc_or_die(2);
-                        temp[0] = result[j];
-                        temp[1] = '\0';
-                        char* new_result = run_transformation(trans.items, temp);
-                        if (new_result) {
-                            String_appendCStr(&str, new_result);
-                            free_or_die(&new_result);
-                        }
-                    }
-                    String_appendTerminator(&str);
-                    String_free(trans);
-                    free_and_replace(&result, str.items);
-                }
-                break;
-            case 'L': // limit length (e.g. l10)
-                {
-                    checkIncrement();
-                    while (isSpace(transformation[i])) checkIncrement();
-                    int limit = 0;
-                    while (isDigit(transformation[i])) {
-                        limit = limit * 10 + (transformation[i] - '0');
-                        i++; // increment to skip the digit, checked by isDigit
-                    }
-                    i--;
-                    if (limit < 0) {
-                        return result; // invalid limit, return original result
-                    }
-                    size_t result_len = strlen(result);
-                    if (result_len > (size_t)limit) {
-                        char* new_result = malloc_or_die(limit + 1);
-                        strncpy(new_result, result, limit);
-                        new_result[limit] = '\0';
-                        free_and_replace(&result, new_result);
-                    }
-                }
-                break;
-            case '@': // only for nth char (e.g. @3)
-                {
-                    checkIncrement();
-                    while (isSpace(transformation[i])) checkIncrement();
-                    size_t charN = 0;
-                    while (isDigit(transformation[i])) {
-                        charN = charN * 10 + (transformation[i] - '0');
-                        i++; // increment to skip the digit, checked by isDigit
-                    }
-                    if (charN < 0) {
-                        return result; // invalid charN, return original result
-                    }
+// Runs a program on c->result, or copies why it failed to c->error and returns false.
+static bool run_caught(const Program* program, Connection* c) {
+    jmp_buf* outer = error_jump;
+    jmp_buf jump;
+    if (setjmp(jump) == 0) {
+        error_jump = &jump;
+        run_program(program, &c->result, &c->ctx);
+        error_jump = outer;
+        return true;
+    }
+    error_jump = outer;
+    snprintf(c->error, sizeof(c->error), "%s", error_text());
+    free_string(&c->result);
+    free_context(&c->ctx);
+    c->ctx = (Context) {0};
+    return false;
+}
 
-                    size_t result_len = strlen(result);
-                    if (charN >= result_len) {
-                        return result; // no change if charN is out of bounds
-                    }
+// Parses the netstring `<length>:<bytes>,` at the start of `data`. Returns its size, or 0 if it is not complete yet.
+size_t parse_netstring(const char* data, size_t len, const char** value, size_t* value_len) {
+    size_t i = 0;
+    size_t n = 0;
+    for (; i < len && isDigit(data[i]); ++i) {
+        assert_msg(n <= (SIZE_MAX - 9) / 10 - 2, "Malformed request: length too large");
+        n = n * 10 + (data[i] - '0');
+    }
+    if (i == len) return 0;
+    assert_msgf(i > 0 && data[i] == ':', "Malformed request: expected a length followed by ':', got 0x%02x", (unsigned char) data[i]);
+    if (len - i - 1 < n + 1) return 0;
+    assert_msg(data[i + 1 + n] == ',', "Malformed request: expected ',' after the data");
+    *value = data + i + 1;
+    *value_len = n;
+    return i + n + 2;
+}
 
-                    String trans = read_transformation(transformation, &i);
-
-                    char* new_result = malloc_or_die(2);
-                    new_result[0] = result[charN];
-                    new_result[1] = '\0';
-                    char* transformed = run_transformation(trans.items, new_result);
-                    // insert the transformed char at the position of charN
-                    char* new = malloc_or_die(result_len + strlen(transformed) + 1);
-                    strncpy(new, result, charN);
-                    strcpy(new + charN, transformed);
-                    strcpy(new + charN + strlen(transformed), result + charN + 1);
-                    
-                    free_and_replace(&result, new);
-
-                    free_or_die(&transformed);
-                    String_free(trans);
-                    free_or_die(&new_result);
-                }
-                break;
-            case '\'':
-                {
-                    String name = {0};
-                    checkIncrement();
-                    while (transformation[i] != '\'') {
-                        String_appendChar(&name, transformation[i]);
-                        checkIncrement();
-                    }
-                    String_appendCStr(&name, ".basket");
-                    String_appendTerminator(&name);
-                    
-                    // look through all files in the current directory and ~/.egg/**/**/
-                    // if the file exists, read it and run the transformation
-                    char* home = getenv("HOME");
-                    assert_msg(home != NULL, "HOME environment variable is not set");
-                    
-                    String home_dir = {0};
-
-                    String_appendCStr(&home_dir, home);
-                    String_appendChar(&home_dir, '/');
-                    String_appendCStr(&home_dir, ".egg");
-                    String_appendTerminator(&home_dir);
-                    char* dirs[] = {
-                        home_dir.items,
-                        ".",
-                    };
-                    
-                    // add the current directory and ~/.egg/ to the search paths
-                    char* file = find_in_multiple_dirs((const char**) dirs, 2, name.items);
-                    assert_msgf(file != NULL, "Could not find file %s in directories", name.items);
-                    String_free(home_dir);
-                    
-                    char* file_content = file_contents_without_lines_with_hash(file);
-                    
-                    free_and_replace(&result, run_transformation(file_content, duplicate_string(result)));
-                    free_or_die(&file_content);
-                    free_or_die(&file);
-                    String_free(name);
-                }
-                break;
-            case '{': // match and replace
-                {
-                    struct {
-                        struct match_replace {
-                            char* from;
-                            char* to;
-                        }* items;
-                        size_t count;
-                        size_t capacity;
-                    } match_replace = {0};
-                    checkIncrement();
-                    
-                    while (transformation[i] != '}' && transformation[i] != 0) {
-                        while (isSpace(transformation[i])) checkIncrement();
-                        String from = read_string(transformation, &i);
-                        checkIncrement();
-                        while (isSpace(transformation[i])) checkIncrement();
-                        checkIncrement(); // skip '='
-                        while (isSpace(transformation[i])) checkIncrement();
-                        String to = read_string(transformation, &i);
-                        checkIncrement();
-                        while (isSpace(transformation[i])) checkIncrement();
+static void flush_answers(Connection* c) {
+    write_all(c->out, c->answers.items, c->answers.count);
+    c->answers.count = 0;
+}
 
-                        struct match_replace item = {
-                            .from = from.items,
-                            .to = to.items
-                        };
-                        String_appendChar(&match_replace, item);
-                    }
+static void answer(Connection* c, const char* data, size_t len, bool failed) {
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "%s%zu:", failed ? "!" : "", len);
+    String_appendMany(&c->answers, header, header_len);
+    if (len >= ANSWER_BUFFER_SIZE) {
+        flush_answers(c);
+        write_all(c->out, data, len);
+    } else if (len > 0) {
+        String_appendMany(&c->answers, data, len);
+    }
+    String_appendChar(&c->answers, ',');
+    if (c->answers.count >= ANSWER_BUFFER_SIZE) {
+        flush_answers(c);
+    }
+}
 
-                    if (match_replace.items) {
-                        qsort(match_replace.items, match_replace.count, sizeof(struct match_replace), sort_match_replace);
-                    }
+// Writes the answers so far and waits for more requests. Returns false at the end of the input.
+static bool receive_requests(Connection* c) {
+    flush_answers(c);
+    if (c->start > 0) {
+        memmove(c->requests.items, c->requests.items + c->start, c->requests.count - c->start);
+        c->requests.count -= c->start;
+        c->start = 0;
+    }
+    String_reserve(&c->requests, c->requests.count + REQUEST_READ_SIZE);
+    int read_size;
+    do {
+        read_size = read(c->in, c->requests.items + c->requests.count, REQUEST_READ_SIZE);
+    } while (read_size < 0 && errno == EINTR);
+    assert_msg(read_size >= 0, "Could not read the requests");
+    assert_msg(read_size > 0 || c->requests.count == 0, "The last request is incomplete");
+    c->requests.count += read_size;
+    return read_size > 0;
+}
 
-                    String new_result = {0};
-                    for (size_t j = 0; result[j]; ++j) {
-                        bool replaced = false;
-                        for (size_t k = 0; k < match_replace.count; ++k) {
-                            size_t from_len = strlen(match_replace.items[k].from);
-                            if (strncmp(&result[j], match_replace.items[k].from, from_len) == 0) {
-                                String_appendCStr(&new_result, match_replace.items[k].to);
-                                replaced = true;
-                                j += from_len;
-                                if (from_len) j--;
-                                break;
-                            }
-                        }
-                        if (!replaced) {
-                            String_appendChar(&new_result, result[j]);
-                        }
-                    }
-                    String_appendTerminator(&new_result);
-                    free_and_replace(&result, new_result.items);
-                    for (size_t k = 0; k < match_replace.count; ++k) {
-                        free_or_die(&match_replace.items[k].from);
-                        free_or_die(&match_replace.items[k].to);
-                    }
-                    if (match_replace.items) {
-                        String_free(match_replace);
-                    }
-                }
-                break;
-            case '[': // window of commands
-                {
-                    StringList commands = {0};
-                    checkIncrement();
-                    while (transformation[i] != ']' && transformation[i] != 0) {
-                        String trans = read_transformation(transformation, &i);
-                        String_appendChar(&commands, trans);
-                        checkIncrement();
-                    }
-                    
-                    if (commands.count == 0) {
-                        // No commands, just return the result as is
-                        return result;
-                    }
+void answer_requests(Connection* c) {
+    while (true) {
+        const char* transformation;
+        const char* input;
+        size_t transformation_len, input_len;
+        const char* next = c->requests.items + c->start;
+        size_t left = c->requests.count - c->start;
+        size_t first = left > 0 ? parse_netstring(next, left, &transformation, &transformation_len) : 0;
+        size_t second = first > 0 ? parse_netstring(next + first, left - first, &input, &input_len) : 0;
+        if (second == 0) {
+            if (!receive_requests(c)) break;
+            continue;
+        }
+
+        Program program;
+        if (memchr(transformation, '\0', transformation_len)) {
+            snprintf(c->error, sizeof(c->error), "The transformation must not contain NUL bytes");
+            answer(c, c->error, strlen(c->error), true);
+        } else if (!served_program(transformation, transformation_len, &program, c->error)) {
+            answer(c, c->error, strlen(c->error), true);
+        } else {
+            c->result.count = 0;
+            String_appendMany(&c->result, input, input_len);
+            if (run_caught(&program, c)) {
+                answer(c, c->result.items, c->result.count, false);
+            } else {
+                answer(c, c->error, strlen(c->error), true);
+            }
+            free_program(&program);
+        }
+        c->start += first + second;
+    }
+    flush_answers(c);
+}
 
-                    size_t result_len = strlen(result);
-                    String new_result = {0};
+#ifndef _WIN32
+// Answers the requests of a client until it hangs up. A malformed request is answered with
+// an error before hanging up on the client.
+static void* serve_connection(void* arg) {
+    Connection* c = arg;
+    jmp_buf jump;
+    if (setjmp(jump) == 0) {
+        error_jump = &jump;
+        answer_requests(c);
+    } else {
+        const char* message = error_text();
+        char header[32];
+        int header_len = snprintf(header, sizeof(header), "!%zu:", strlen(message));
+        struct iovec iov[3] = { { header, header_len }, { (char*) message, strlen(message) }, { ",", 1 } };
+        if (writev(c->out, iov, 3) < 0) {
+            // the client is gone
+        }
+    }
+    error_jump = NULL;
+    close(c->in);
+    free_connection(c);
+    return NULL;
+}
 
-                    for (size_t j = 0; j < result_len; ++j) {
-                        char* temp = malloc_or_die(2);
-                        temp[0] = result[j];
-                        temp[1] = '\0';
-                        char* new = run_transformation(commands.items[j % commands.count].items, temp);
-                        String_appendCStr(&new_result, new);
-                        free_or_die(&new);
-                    }
-                    String_appendTerminator(&new_result);
-                    for (size_t k = 0; k < commands.count; ++k) {
-                        free_or_die(&commands.items[k].items);
-                    }
-                    String_free(commands);
-                    free_and_replace(&result, new_result.items);
-                }
-                break;
-            case ':': // repeat
-                {
-                    checkIncrement();
-                    String trans = read_transformation(transformation, &i);
-
-                    char* new_result = NULL;
-                    while (1) {
-                        new_result = run_transformation(trans.items, duplicate_string(result));
-                        if (strcmp(new_result, result) == 0) {
-                            free_and_replace(&result, new_result);
-                            break; // no change, stop repeating
-                        }
-                        free_and_replace(&result, new_result);
-                    }
-                    String_free(trans);
-                }
-                break;
+const char* served_socket = NULL;
 
-            default:
-                assert_msgf(false, "Unknown transformation: %c", op);
+static void remove_socket(int signal_number) {
+    unlink(served_socket);
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+// --serve: answers the requests of every client of the socket at `path` in a thread of its own.
+void serve(const char* path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    assert_msgf(strlen(path) < sizeof(address.sun_path), "The socket path '%s' is too long", path);
+    strcpy(address.sun_path, path);
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path); // left behind by a server that was killed
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_msg(server >= 0, "Could not create a socket");
+    assert_msgf(bind(server, (struct sockaddr*) &address, sizeof(address)) == 0, "Could not create the socket %s: %s", path, strerror(errno));
+    assert_msgf(listen(server, SOMAXCONN) == 0, "Could not listen on %s", path);
+
+    served_socket = path;
+    signal(SIGINT, remove_socket);
+    signal(SIGTERM, remove_socket);
+    signal(SIGPIPE, SIG_IGN);
+
+    thread_count(); // settled before the connections look at it
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    while (true) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                nanosleep(&(struct timespec) { .tv_nsec = 10000000 }, NULL); // wait for a client to hang up
+            }
+            assert_msgf(errno != EBADF && errno != EINVAL && errno != ENOTSOCK, "Could not accept a connection: %s", strerror(errno));
+            continue;
+        }
+        Connection* c = malloc_or_die(sizeof(Connection));
+        *c = (Connection) { .in = client, .out = client };
+        pthread_t thread;
+        if (pthread_create(&thread, &attributes, serve_connection, c) != 0) {
+            serve_connection(c); // out of threads, answer it here
         }
-        #undef checkIncrement
     }
-    return result;
+}
+
+static void* send_requests(void* arg) {
+    int server = *(int*) arg;
+    char buffer[STREAM_CHUNK_SIZE];
+    size_t read_size;
+    while ((read_size = read_input(buffer, sizeof(buffer))) > 0) {
+        write_all(server, buffer, read_size);
+    }
+    shutdown(server, SHUT_WR);
+    return NULL;
+}
+
+// --connect: sends standard input to a server started with --serve and writes its answers to
+// standard output. Sending happens on a thread of its own, so that neither side waits for the
+// other to take what it wrote.
+void connect_to_server(const char* path) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    assert_msgf(strlen(path) < sizeof(address.sun_path), "The socket path '%s' is too long", path);
+    strcpy(address.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_msg(server >= 0, "Could not create a socket");
+    assert_msgf(connect(server, (struct sockaddr*) &address, sizeof(address)) == 0, "Could not connect to %s: %s", path, strerror(errno));
+
+    pthread_t sender;
+    assert_msg(pthread_create(&sender, NULL, send_requests, &server) == 0, "Could not start a thread");
+    char buffer[STREAM_CHUNK_SIZE];
+    while (true) {
+        int read_size = read(server, buffer, sizeof(buffer));
+        if (read_size < 0 && errno == EINTR) continue;
+        assert_msg(read_size >= 0, "Could not read from the server");
+        if (read_size == 0) break;
+        write_output(buffer, read_size);
+    }
+    pthread_join(sender, NULL);
+    close(server);
+}
+#endif
+
+// Parses a thread count given as `-j` or in EGG_THREADS.
+size_t parse_thread_count(const char* text) {
+    char* end;
+    unsigned long count = strtoul(text, &end, 10);
+    assert_msgf(*text && *end == '\0' && count > 0, "Invalid thread count: '%s'", text);
+    return count;
+}
+
+// Parses an iteration limit given as --max-iterations or in EGG_MAX_ITERATIONS.
+size_t parse_max_iterations(const char* text) {
+    char* end;
+    unsigned long long count = strtoull(text, &end, 10);
+    assert_msgf(*text && *end == '\0', "Invalid iteration limit: '%s'", text);
+    return (size_t) count;
+}
+
+bool is_number(const char* text) {
+    if (!*text) return false;
+    for (; *text; ++text) {
+        if (!isDigit(*text)) return false;
+    }
+    return true;
 }
 
 int main(int argc, char const *argv[]) {
+    bool print_stats = false;
+    String records = {0}; // record delimiter of --lines and --records
+
+    const char* threads = getenv("EGG_THREADS");
+    if (threads && *threads) {
+        requested_threads = parse_thread_count(threads);
+    }
+    const char* iterations = getenv("EGG_MAX_ITERATIONS");
+    if (iterations && *iterations) {
+        max_iterations = parse_max_iterations(iterations);
+    }
+
+    // options are only recognized before the transformation
+    int first = 1;
+    for (; first < argc; ++first) {
+        if (strcmp(argv[first], "--stats") == 0) {
+            print_stats = true;
+        } else if (strcmp(argv[first], "--profile") == 0) {
+            profiling = true;
+        } else if (strcmp(argv[first], "-j") == 0 && first + 1 < argc && is_number(argv[first + 1])) {
+            requested_threads = parse_thread_count(argv[++first]);
+        } else if (strcmp(argv[first], "--max-iterations") == 0 && first + 1 < argc) {
+            max_iterations = parse_max_iterations(argv[++first]);
+        } else if (strcmp(argv[first], "-i") == 0 && first + 1 < argc) {
+            const char* filename = argv[++first];
+            input_fd = open(filename, O_RDONLY);
+            assert_msgf(input_fd >= 0, "Could not open file %s", filename);
+        } else if (strcmp(argv[first], "--compile") == 0 && first + 1 < argc) {
+            write_compiled_basket(argv[first + 1]);
+            free_basket_cache();
+            free_basket_indexes();
+            free_string(&records);
+            return 0;
+        } else if (strcmp(argv[first], "--batch") == 0) {
+            Connection* c = malloc_or_die(sizeof(Connection));
+            *c = (Connection) { .in = input_fd, .out = STDOUT_FILENO };
+            answer_requests(c);
+            free_connection(c);
+            pool_stop();
+            free_served_programs();
+            free_basket_cache();
+            free_basket_indexes();
+            free_string(&records);
+            return 0;
+        } else if ((strcmp(argv[first], "--serve") == 0 || strcmp(argv[first], "--connect") == 0) && first + 1 < argc) {
+#ifndef _WIN32
+            if (strcmp(argv[first], "--serve") == 0) {
+                serve(argv[first + 1]);
+            }
+            connect_to_server(argv[first + 1]);
+            free_string(&records);
+            return 0;
+#else
+            assert_msgf(false, "%s needs Unix sockets, use --batch instead", argv[first]);
+#endif
+        } else if (strcmp(argv[first], "--lines") == 0) {
+            records.count = 0;
+            String_appendChar(&records, '\n');
+        } else if (strncmp(argv[first], "--records=", 10) == 0) {
+            const char* delimiter = argv[first] + 10;
+            records.count = 0;
+            unescape_chars(delimiter, strlen(delimiter), strlen(delimiter), &records);
+            assert_msg(records.count > 0, "The record delimiter must not be empty");
+        } else {
+            break;
+        }
+    }
+
     String transform = {0};
-    for (int i = 1; i < argc; ++i) {
-        if (i > 1) {
+    for (int i = first; i < argc; ++i) {
+        if (i > first) {
             String_appendCStr(&transform, " ");
         }
         String_appendCStr(&transform, argv[i]);
     }
     String_appendTerminator(&transform);
 
-    String str = {0};
-    char data[512];
-    while (fgets(data, sizeof(data), stdin) != NULL) {
-        String_appendCStr(&str, data);
+    Arena scratch = {0};
+    Program program = compile_transformation(transform.items, 0, &scratch);
+    arena_free(&scratch);
+    if (profiling) {
+        attach_profiles(&program);
     }
-    String_appendTerminator(&str);
+    size_t compile_allocations = allocation_count;
+    uint64_t start = monotonic_ns();
+    map_input();
+    if (records.count > 0) {
+        run_records(&program, &records);
+    } else {
+        run_program_streaming(&program);
+    }
+    pool_stop();
+    unmap_input();
 
-    if (str.items) {
-        char* result = run_transformation(transform.items, str.items);
-        printf("%s", result);
-        free_or_die(&result);
+    if (print_stats) {
+        fprintf(stderr, "allocations: %zu while compiling, %zu while running\n", compile_allocations, allocation_count - compile_allocations);
     }
+    if (profiling) {
+        fprintf(stderr, "%-28s %10s %12s %14s %14s %12s\n", "node", "calls", "time (ms)", "bytes in", "bytes out", "allocations");
+        print_profile(&program, 0);
+        fprintf(stderr, "%-28s %10s %12.3f\n", "total", "", (monotonic_ns() - start) / 1e6);
+    }
+
+    free_program(&program);
+    free_basket_cache();
+    free_basket_indexes();
     String_free(transform);
+    free_string(&records);
     return 0;
 }
+#endif // EGG_LIBRARY
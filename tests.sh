@@ -5,6 +5,11 @@ check() {
     fi
 }
 
+# Allocations made while compiling a transformation, which are fewer when a basket it uses is precompiled.
+compile_allocations() {
+    echo | ./egg --stats "$1" 2>&1 >/dev/null | sed -n 's/allocations: \([0-9]*\) while compiling.*/\1/p'
+}
+
 check "$(echo "Hello World" | ./egg "-ua\n")"           "HELLO WORLD"
 check "$(echo "Hello World" | ./egg "-la\n")"           "hello world"
 check "$(echo "hello world" | ./egg "-Ca\n")"           "Hello World"
@@ -24,3 +29,36 @@ check "$(echo "LeetCode" | egg "'leetify'")"            "1337C0d3"
 check "$(echo "hello, world!" | egg "x'o, world'")"     "hell!"
 check "$(echo "aaxyxbbxyxcc" | egg "|'xyx'u")"          "AAxyxBBxyxCC"
 check "$(echo "hello, world!" | egg "x', world'u")"     "HELLO!"
+check "$(echo "hello" | ./egg "@1u")"                   "hEllo"
+check "$(head -c 70000 /dev/zero | tr '\0' a | ./egg "{'aaa' = 'b'}" | tr -d a | wc -c)" "23333"
+check "$(head -c 200000 /dev/zero | tr '\0' a | ./egg "|',,'(r)d" | wc -c)" "400000"
+check "$( (printf 'ab,'; sleep 0.1; printf ',cd,'; sleep 0.1; printf ',ef') | ./egg "|',,'(u)")" "AB,,CD,,EF"
+check "$(printf 'a\0b' | ./egg "bBh")"                  "610062"
+check "$(echo "  Hello World, hello egg! 0123456789 @[\`{ Mixed CASE text	" | ./egg "ij")" "__hELLO_wORLD,_HELLO_EGG!_0123456789_@[\`{_mIXED_case_TEXT__"
+check "$(printf '\373\377hello' | ./egg "b")"            "+/9oZWxsbw=="
+check "$(printf '\373\377hello' | ./egg "wWv")"          "+/9oZWxsbw"
+check "$(printf 'aGVs\nbG8=\n' | ./egg "B")"            "hello"
+check "$(printf 'egg\377' | ./egg "X")"                 "656767FF"
+check "$(echo "65 67 67 Ff" | ./egg "Hh")"              "656767ff"
+check "$(printf '123456789' | ./egg "k")"               "e3069283"
+check "$(printf 'Nobody inspects the spammish repetition' | ./egg "K")" "fbcea83c8a378bf1"
+check "$(echo "abcabxb" | ./egg "{'ab' = '1' 'abc' = '2' 'bx' = '3' 'b' = '4'}")" "21x4"
+check "$(echo "abcabxb" | ./egg "x{'ab' 'abc' 'x'}")"  "b"
+check "$(echo "ab c,,  De f ,ghi" | ./egg "|,(tr-)")"   "c b,f e,ih"
+check "$(printf 'ab%.0s' $(seq 200) | ./egg -j 3 "[u l]c")" "f62c3ae9"
+check "$(printf 'ab\ncd\n\nef' | ./egg --lines "r(a!)")" "$(printf 'ba!\ndc!\n!\nfe!')"
+check "$(printf 'a;bb;;c' | ./egg "--records=;" "(p<)u")" "<A;<BB;<;<C"
+check "$(./egg -i README.md "rrL7u")"                   "# \`EGG\`"
+check "$(printf 'a\0b' | ./egg "." | ./egg "h")"        "610062"
+check "$(./egg --compile eggbaskets/leetify.basket && echo "LeetCode" | ./egg "'leetify'"; rm -f eggbaskets/leetify.eggc)" "1337C0d3"
+check "$(printf '#include <egg.h>\n#include <stdio.h>\nint main(void) { egg_program* p; egg_buffer out = {0}; egg_compile("u", &p); egg_run(p, "egg", 3, &out); printf("%%.*s", (int) out.len, out.data); return 0; }' | clang -Iinclude -x c - -x none libegg.a -pthread -o libegg_test && ./libegg_test; rm -f libegg_test)" "EGG"
+check "$(printf '1:u,5:hello,1:B,2:a!,' | ./egg --batch)" "5:HELLO,!47:Invalid base64 input: unexpected character 0x21,"
+check "$(./egg --serve egg_test.sock & while [ ! -S egg_test.sock ]; do sleep 0.01; done; printf '3:l u,3:egg,' | ./egg --connect egg_test.sock; kill $!)" "3:EGG,"
+check "$(printf 'hello' | ./egg --profile "E(u)" 2>&1 >/dev/null | awk '$1 == "u" { print $2, $4, $5 }')" "5 5 5"
+check "$(echo "LeetCode" | ./egg "l {'e'='3'} u ^ ^")" "9dcc9c9c9c9c9e9d9d9c9dcf9d9d9c9c99ca"
+check "$(printf 'abc%.0s' $(seq 100) | ./egg "[(ud) (x'b') h]c")" "96f0d95f"
+check "$(printf '2::i,2:aB,4::(-),3:abc,' | ./egg --max-iterations 3 --batch)" "!71:Transformation ':' never settles, its result repeats every 2 iterations,!53:Transformation ':' did not settle within 3 iterations,"
+check "$(for i in $(seq 2000); do if [ $i = 1500 ]; then echo "a!"; else echo "aGk="; fi; done | ./egg -j 4 "|'\n'(B)" 2>&1 >/dev/null | sed 's/.*Assertion failed: //')" "Invalid base64 input: unexpected character 0x21"
+check "$(printf "d {'ab' = 'c'} L9\n" > egg_test.basket; before=$(compile_allocations "'egg_test'"); ./egg --compile egg_test.basket; after=$(compile_allocations "'egg_test'"); echo xab | ./egg "'egg_test'"; [ "$after" -lt "$before" ] && echo precompiled; rm -f egg_test.basket egg_test.eggc)" "$(printf 'xc\nxc\nprecompiled')"
+check "$(printf "l 'leetify' u\n" > egg_test.basket; before=$(compile_allocations "'egg_test'"); ./egg --compile egg_test.basket; after=$(compile_allocations "'egg_test'"); echo LeetCode | ./egg "'egg_test'"; [ "$after" -lt "$before" ] && echo precompiled; rm -f egg_test.basket egg_test.eggc)" "$(printf '1337C0D3\nprecompiled')"
+check "$(printf "{'ab' = 'xyzzy'}\n" > egg_test.basket; ./egg --compile egg_test.basket; LC_ALL=C sed -i 's/xyzzy/xyzzz/' egg_test.eggc; echo abc | ./egg "'egg_test'"; rm -f egg_test.basket egg_test.eggc)" "xyzzyc"